@@ -25,6 +25,7 @@ include $(CLEAR_VARS)
 
 LOCAL_SRC_FILES := \
 	gralloc_gbm.cpp \
+	gralloc_soft.cpp \
 	gralloc.cpp
 
 LOCAL_SHARED_LIBRARIES := \
@@ -55,3 +56,25 @@ LOCAL_MODULE_TAGS := optional
 LOCAL_PROPRIETARY_MODULE := true
 
 include $(BUILD_SHARED_LIBRARY)
+
+ifneq ($(TARGET_USE_MESA),false)
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+	gralloc_bench.cpp \
+	gralloc_gbm.cpp \
+	gralloc_soft.cpp
+
+LOCAL_SHARED_LIBRARIES := \
+	libdrm \
+	libgbm_mesa \
+	liblog \
+	libcutils \
+	libhardware \
+
+LOCAL_MODULE := gralloc_gbm_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_PROPRIETARY_MODULE := true
+
+include $(BUILD_EXECUTABLE)
+endif
@@ -40,6 +40,7 @@
 
 #include "gralloc_drm.h"
 #include "gralloc_gbm_priv.h"
+#include "gralloc_gbm_handle.h"
 
 #define CROS_GRALLOC_DRM_GET_BUFFER_INFO 4
 
@@ -55,26 +56,30 @@ struct cros_gralloc0_buffer_info {
 struct gbm_module_t {
 	gralloc_module_t base;
 
+	/* only guards gbm device creation, buffers have their own locks */
 	pthread_mutex_t mutex;
 	struct gbm_device *gbm;
+	/* no render node, buffers come from the software backend */
+	bool soft;
 };
 
 /*
- * Initialize the DRM device object
+ * Initialize the DRM device object, falling back to the software backend
+ * when there is no render node to open.
  */
 static int gbm_init(struct gbm_module_t *dmod)
 {
-	int err = 0;
-
 	pthread_mutex_lock(&dmod->mutex);
-	if (!dmod->gbm) {
+	if (!dmod->gbm && !dmod->soft) {
 		dmod->gbm = gbm_dev_create();
-		if (!dmod->gbm)
-			err = -EINVAL;
+		if (!dmod->gbm) {
+			ALOGW("no gbm device, using software buffers");
+			dmod->soft = true;
+		}
 	}
 	pthread_mutex_unlock(&dmod->mutex);
 
-	return err;
+	return 0;
 }
 
 static int get_fourcc(int format)
@@ -91,8 +96,7 @@ static int get_fourcc(int format)
 	case HAL_PIXEL_FORMAT_BGRA_8888:
 		return DRM_FORMAT_ARGB8888;
 	case HAL_PIXEL_FORMAT_YV12:
-		/* YV12 is planar, but must be a single buffer so ask for GR88 */
-		return DRM_FORMAT_GR88;
+		return DRM_FORMAT_YVU420;
 	case HAL_PIXEL_FORMAT_RGBA_FP16:
 		return DRM_FORMAT_ABGR16161616F;
 	case HAL_PIXEL_FORMAT_RGBA_1010102:
@@ -113,6 +117,7 @@ static int gbm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 	buffer_handle_t handle;
 	struct cros_gralloc0_buffer_info *info;
 	struct gralloc_handle_t *hnd;
+	struct gralloc_gbm_handle_t *gbm_hnd;
 
 	err = gbm_init(dmod);
 	if (err)
@@ -123,7 +128,29 @@ static int gbm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 	case GRALLOC_MODULE_PERFORM_GET_DRM_FD:
 		{
 			int *fd = va_arg(args, int *);
-			*fd = gbm_device_get_fd(dmod->gbm);
+			if (dmod->soft) {
+				*fd = -1;
+				err = -ENODEV;
+			} else {
+				*fd = gbm_device_get_fd(dmod->gbm);
+				err = 0;
+			}
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_GET_ALLOC_STATS:
+		{
+			struct gralloc_gbm_alloc_stats *stats =
+				va_arg(args, struct gralloc_gbm_alloc_stats *);
+			gralloc_gbm_get_alloc_stats(stats);
+			err = 0;
+		}
+		break;
+	case GRALLOC_MODULE_PERFORM_GET_BUFFER_INVENTORY:
+		{
+			struct gralloc_gbm_buffer_info *buffers =
+				va_arg(args, struct gralloc_gbm_buffer_info *);
+			uint32_t *count = va_arg(args, uint32_t *);
+			*count = gralloc_gbm_get_inventory(buffers, buffers ? *count : 0);
 			err = 0;
 		}
 		break;
@@ -131,14 +158,28 @@ static int gbm_mod_perform(const struct gralloc_module_t *mod, int op, ...)
 		{
 			handle = va_arg(args, buffer_handle_t);
 			hnd = gralloc_handle(handle);
+			gbm_hnd = gralloc_gbm_handle(handle);
 			info = va_arg(args, struct cros_gralloc0_buffer_info *);
 			memset(info, 0, sizeof(*info));
-			info->drm_fourcc = get_fourcc(hnd->format);
-			info->num_fds = 1;
-			info->fds[0] = hnd->prime_fd;
 			info->modifier = hnd->modifier;
-			info->stride[0] = hnd->stride;
-			info->offset[0] = 0;
+			if (gbm_hnd && gbm_hnd->num_planes > 1) {
+				/* every plane lives behind the same fd */
+				info->drm_fourcc = get_fourcc(hnd->format);
+				if (!info->drm_fourcc)
+					info->drm_fourcc = gbm_hnd->drm_format;
+				info->num_fds = gbm_hnd->num_planes;
+				for (uint32_t i = 0; i < gbm_hnd->num_planes; i++) {
+					info->fds[i] = hnd->prime_fd;
+					info->stride[i] = gbm_hnd->strides[i];
+					info->offset[i] = gbm_hnd->offsets[i];
+				}
+			} else {
+				info->drm_fourcc = get_fourcc(hnd->format);
+				info->num_fds = 1;
+				info->fds[0] = hnd->prime_fd;
+				info->stride[0] = hnd->stride;
+				info->offset[0] = 0;
+			}
 			err = 0;
 		}
 		break;
@@ -161,9 +202,10 @@ static int gbm_mod_register_buffer(const gralloc_module_t *mod,
 	if (err)
 		return err;
 
-	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_handle_register(handle, dmod->gbm);
-	pthread_mutex_unlock(&dmod->mutex);
+	if (dmod->soft)
+		err = gralloc_soft_handle_register(handle);
+	else
+		err = gralloc_gbm_handle_register(handle, dmod->gbm);
 
 	return err;
 }
@@ -174,9 +216,10 @@ static int gbm_mod_unregister_buffer(const gralloc_module_t *mod,
 	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_handle_unregister(handle);
-	pthread_mutex_unlock(&dmod->mutex);
+	if (dmod->soft)
+		err = gralloc_soft_handle_unregister(handle);
+	else
+		err = gralloc_gbm_handle_unregister(handle);
 
 	return err;
 }
@@ -187,12 +230,12 @@ static int gbm_mod_lock(const gralloc_module_t *mod, buffer_handle_t handle,
 	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
-
-	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, ptr);
+	if (dmod->soft)
+		err = gralloc_soft_bo_lock(handle, usage, ptr);
+	else
+		err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, ptr);
 	ALOGV("buffer %p lock usage = %08x", handle, usage);
 
-	pthread_mutex_unlock(&dmod->mutex);
 	return err;
 }
 
@@ -201,9 +244,10 @@ static int gbm_mod_unlock(const gralloc_module_t *mod, buffer_handle_t handle)
 	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_bo_unlock(handle);
-	pthread_mutex_unlock(&dmod->mutex);
+	if (dmod->soft)
+		err = gralloc_soft_bo_unlock(handle);
+	else
+		err = gralloc_gbm_bo_unlock(handle);
 
 	return err;
 }
@@ -214,9 +258,10 @@ static int gbm_mod_lock_ycbcr(gralloc_module_t const *mod, buffer_handle_t handl
 	struct gbm_module_t *dmod = (struct gbm_module_t *) mod;
 	int err;
 
-	pthread_mutex_lock(&dmod->mutex);
-	err = gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
-	pthread_mutex_unlock(&dmod->mutex);
+	if (dmod->soft)
+		err = gralloc_soft_bo_lock_ycbcr(handle, usage, ycbcr);
+	else
+		err = gralloc_gbm_bo_lock_ycbcr(handle, usage, x, y, w, h, ycbcr);
 
 	return err;
 }
@@ -226,22 +271,30 @@ static int gbm_mod_close_gpu0(struct hw_device_t *dev)
 	struct gbm_module_t *dmod = (struct gbm_module_t *)dev->module;
 	struct alloc_device_t *alloc = (struct alloc_device_t *) dev;
 
-	gbm_dev_destroy(dmod->gbm);
+	if (dmod->gbm)
+		gbm_dev_destroy(dmod->gbm);
+	dmod->gbm = NULL;
 	delete alloc;
 
 	return 0;
 }
 
+static void gbm_mod_dump_gpu0(struct alloc_device_t * /*dev*/, char *buff, int buff_len)
+{
+	gralloc_gbm_dump(buff, buff_len);
+}
+
 static int gbm_mod_free_gpu0(alloc_device_t *dev, buffer_handle_t handle)
 {
 	struct gbm_module_t *dmod = (struct gbm_module_t *) dev->common.module;
 
-	pthread_mutex_lock(&dmod->mutex);
-	gbm_free(handle);
+	if (dmod->soft)
+		gralloc_soft_bo_free(handle);
+	else
+		gralloc_gbm_bo_free(handle);
 	native_handle_close(handle);
 	delete handle;
 
-	pthread_mutex_unlock(&dmod->mutex);
 	return 0;
 }
 
@@ -252,14 +305,14 @@ static int gbm_mod_alloc_gpu0(alloc_device_t *dev,
 	struct gbm_module_t *dmod = (struct gbm_module_t *) dev->common.module;
 	int err = 0;
 
-	pthread_mutex_lock(&dmod->mutex);
-
-	*handle = gralloc_gbm_bo_create(dmod->gbm, w, h, format, usage, stride);
+	if (dmod->soft)
+		*handle = gralloc_soft_bo_create(w, h, format, usage, stride);
+	else
+		*handle = gralloc_gbm_bo_create(dmod->gbm, w, h, format, usage, stride);
 	if (!*handle)
 		err = -errno;
 
 	ALOGV("buffer %p usage = %08x", *handle, usage);
-	pthread_mutex_unlock(&dmod->mutex);
 	return err;
 }
 
@@ -283,6 +336,7 @@ static int gbm_mod_open_gpu0(struct gbm_module_t *dmod, hw_device_t **dev)
 
 	alloc->alloc = gbm_mod_alloc_gpu0;
 	alloc->free = gbm_mod_free_gpu0;
+	alloc->dump = gbm_mod_dump_gpu0;
 
 	*dev = &alloc->common;
 
@@ -328,4 +382,5 @@ struct gbm_module_t HAL_MODULE_INFO_SYM = {
 
 	.mutex = PTHREAD_MUTEX_INITIALIZER,
 	.gbm = NULL,
+	.soft = false,
 };
@@ -0,0 +1,529 @@
+/*
+ * Copyright (C) 2026 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Allocator benchmark. Drives the gralloc.gbm internals directly with the
+ * buffer mixes Android produces and reports per-call latency and memory
+ * footprint, single threaded and with several threads at once.
+ *
+ *   gralloc_gbm_bench [-d node | -s] [-w ui,video,cursor,camera]
+ *                     [-t 1,2,4,8] [-n iterations] [-q depth]
+ *                     [-m often|rarely] [-f]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <time.h>
+
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#include <gbm.h>
+
+#include "gralloc_drm.h"
+#include "gralloc_gbm_priv.h"
+#include "gralloc_gbm_handle.h"
+#include <android/gralloc_handle.h>
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <vector>
+
+struct workload {
+	const char *name;
+	int width;
+	int height;
+	int format;
+	int hw_usage;
+	int sw_usage;
+	bool ycbcr;
+};
+
+static const struct workload workloads[] = {
+	{ "ui", 1920, 1080, HAL_PIXEL_FORMAT_RGBA_8888,
+	  GRALLOC_USAGE_HW_TEXTURE | GRALLOC_USAGE_HW_RENDER | GRALLOC_USAGE_HW_COMPOSER,
+	  GRALLOC_USAGE_SW_READ_RARELY | GRALLOC_USAGE_SW_WRITE_RARELY, false },
+	{ "video", 3840, 2160, HAL_PIXEL_FORMAT_YV12,
+	  GRALLOC_USAGE_HW_TEXTURE,
+	  GRALLOC_USAGE_SW_READ_OFTEN | GRALLOC_USAGE_SW_WRITE_OFTEN, true },
+	{ "cursor", 64, 64, HAL_PIXEL_FORMAT_RGBA_8888,
+	  GRALLOC_USAGE_CURSOR | GRALLOC_USAGE_HW_COMPOSER,
+	  GRALLOC_USAGE_SW_WRITE_OFTEN, false },
+	{ "camera", 1920, 1080, HAL_PIXEL_FORMAT_YCbCr_420_888,
+	  GRALLOC_USAGE_HW_CAMERA_WRITE | GRALLOC_USAGE_HW_TEXTURE,
+	  GRALLOC_USAGE_SW_READ_OFTEN, true },
+};
+
+enum {
+	OP_CREATE,
+	OP_REGISTER,
+	OP_LOCK,
+	OP_UNLOCK,
+	OP_UNREGISTER,
+	OP_FREE,
+	OP_SHARED_LOCK,
+	OP_SHARED_UNLOCK,
+	OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {
+	"create", "register", "lock", "unlock", "unregister", "free",
+	"lock (shared)", "unlock (shared)",
+};
+
+/* a null device selects the software backend */
+static struct gbm_device *bench_gbm;
+
+static int iterations = 200;
+static int depth = 3;
+static int sw_override;
+static bool fill;
+
+static std::atomic<int64_t> live_bytes;
+static std::atomic<int64_t> peak_bytes;
+
+struct bench_run {
+	const struct workload *wl;
+	int usage;
+	int lock_usage;
+	pthread_barrier_t start;
+	pthread_barrier_t done;
+	pthread_barrier_t release;
+	buffer_handle_t shared;
+	std::vector<uint64_t> samples[OP_COUNT];
+	pthread_mutex_t mutex;
+	int errors;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static long rss_kb(void)
+{
+	long size, resident;
+	FILE *f = fopen("/proc/self/statm", "r");
+
+	if (!f)
+		return 0;
+	if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+		resident = 0;
+	fclose(f);
+
+	return resident * (getpagesize() / 1024);
+}
+
+static buffer_handle_t bench_create(const struct bench_run *run)
+{
+	int stride;
+
+	if (bench_gbm)
+		return gralloc_gbm_bo_create(bench_gbm, run->wl->width,
+				run->wl->height, run->wl->format, run->usage, &stride);
+	return gralloc_soft_bo_create(run->wl->width, run->wl->height,
+			run->wl->format, run->usage, &stride);
+}
+
+static void bench_free(buffer_handle_t handle)
+{
+	if (bench_gbm)
+		gralloc_gbm_bo_free(handle);
+	else
+		gralloc_soft_bo_free(handle);
+	native_handle_close(handle);
+	native_handle_delete((native_handle_t *)handle);
+}
+
+static int bench_register(buffer_handle_t handle)
+{
+	if (bench_gbm)
+		return gralloc_gbm_handle_register(handle, bench_gbm);
+	return gralloc_soft_handle_register(handle);
+}
+
+static int bench_unregister(buffer_handle_t handle)
+{
+	if (bench_gbm)
+		return gralloc_gbm_handle_unregister(handle);
+	return gralloc_soft_handle_unregister(handle);
+}
+
+static int bench_lock(const struct bench_run *run, buffer_handle_t handle,
+		void **addr)
+{
+	const struct workload *wl = run->wl;
+	struct android_ycbcr ycbcr;
+	int err;
+
+	if (wl->ycbcr) {
+		if (bench_gbm)
+			err = gralloc_gbm_bo_lock_ycbcr(handle, run->lock_usage,
+					0, 0, wl->width, wl->height, &ycbcr);
+		else
+			err = gralloc_soft_bo_lock_ycbcr(handle, run->lock_usage, &ycbcr);
+		*addr = ycbcr.y;
+		return err;
+	}
+
+	if (bench_gbm)
+		return gralloc_gbm_bo_lock(handle, run->lock_usage,
+				0, 0, wl->width, wl->height, addr);
+	return gralloc_soft_bo_lock(handle, run->lock_usage, addr);
+}
+
+static int bench_unlock(buffer_handle_t handle)
+{
+	if (bench_gbm)
+		return gralloc_gbm_bo_unlock(handle);
+	return gralloc_soft_bo_unlock(handle);
+}
+
+static int64_t buffer_size(buffer_handle_t handle)
+{
+	off_t size = lseek(gralloc_handle(handle)->prime_fd, 0, SEEK_END);
+
+	return size > 0 ? size : 0;
+}
+
+static void account(int64_t delta)
+{
+	int64_t cur = live_bytes += delta;
+	int64_t peak = peak_bytes;
+
+	while (cur > peak && !peak_bytes.compare_exchange_weak(peak, cur))
+		;
+}
+
+/*
+ * One client: allocate, import the buffer the way another process would,
+ * touch it from the CPU, and keep the last few buffers alive like a
+ * buffer queue does.
+ */
+static void *bench_thread(void *arg)
+{
+	struct bench_run *run = (struct bench_run *)arg;
+	std::vector<uint64_t> samples[OP_COUNT];
+	std::vector<buffer_handle_t> queue;
+	int errors = 0;
+	uint64_t t;
+
+	pthread_barrier_wait(&run->start);
+
+	for (int i = 0; i < iterations; i++) {
+		buffer_handle_t handle;
+		native_handle_t *imported;
+		void *addr = NULL;
+
+		t = now_ns();
+		handle = bench_create(run);
+		samples[OP_CREATE].push_back(now_ns() - t);
+		if (!handle) {
+			errors++;
+			continue;
+		}
+		account(buffer_size(handle));
+
+		imported = native_handle_clone(handle);
+		t = now_ns();
+		if (!imported || bench_register(imported)) {
+			errors++;
+		} else {
+			samples[OP_REGISTER].push_back(now_ns() - t);
+
+			t = now_ns();
+			if (bench_lock(run, imported, &addr)) {
+				errors++;
+			} else {
+				samples[OP_LOCK].push_back(now_ns() - t);
+
+				/* the first plane is all a region lock is sure to map */
+				if (fill && addr && (run->lock_usage & GRALLOC_USAGE_SW_WRITE_MASK))
+					memset(addr, i, (size_t)gralloc_handle(imported)->stride *
+							run->wl->height);
+
+				t = now_ns();
+				bench_unlock(imported);
+				samples[OP_UNLOCK].push_back(now_ns() - t);
+			}
+
+			t = now_ns();
+			bench_unregister(imported);
+			samples[OP_UNREGISTER].push_back(now_ns() - t);
+		}
+		if (imported) {
+			native_handle_close(imported);
+			native_handle_delete(imported);
+		}
+
+		queue.push_back(handle);
+		if ((int)queue.size() > depth) {
+			handle = queue.front();
+			queue.erase(queue.begin());
+			account(-buffer_size(handle));
+			t = now_ns();
+			bench_free(handle);
+			samples[OP_FREE].push_back(now_ns() - t);
+		}
+	}
+
+	/* everyone on the same buffer, as with a shared cursor or preview */
+	for (int i = 0; run->shared && i < iterations; i++) {
+		void *addr;
+
+		t = now_ns();
+		if (bench_lock(run, run->shared, &addr)) {
+			errors++;
+			continue;
+		}
+		samples[OP_SHARED_LOCK].push_back(now_ns() - t);
+
+		t = now_ns();
+		bench_unlock(run->shared);
+		samples[OP_SHARED_UNLOCK].push_back(now_ns() - t);
+	}
+
+	/* let the main thread sample the footprint with the queues full */
+	pthread_barrier_wait(&run->done);
+	pthread_barrier_wait(&run->release);
+
+	for (buffer_handle_t handle : queue) {
+		account(-buffer_size(handle));
+		bench_free(handle);
+	}
+
+	pthread_mutex_lock(&run->mutex);
+	for (int op = 0; op < OP_COUNT; op++)
+		run->samples[op].insert(run->samples[op].end(),
+				samples[op].begin(), samples[op].end());
+	run->errors += errors;
+	pthread_mutex_unlock(&run->mutex);
+
+	return NULL;
+}
+
+static double percentile(std::vector<uint64_t> &samples, int p)
+{
+	size_t idx = (samples.size() - 1) * p / 100;
+
+	std::nth_element(samples.begin(), samples.begin() + idx, samples.end());
+	return samples[idx] / 1000.0;
+}
+
+static void bench_workload(const struct workload *wl, int threads)
+{
+	struct bench_run run;
+	std::vector<pthread_t> tids(threads);
+	long rss_before, rss_full;
+	uint64_t t;
+
+	run.wl = wl;
+	run.lock_usage = sw_override ? sw_override : wl->sw_usage;
+	run.usage = wl->hw_usage | run.lock_usage;
+	run.errors = 0;
+	pthread_mutex_init(&run.mutex, NULL);
+	pthread_barrier_init(&run.start, NULL, threads + 1);
+	pthread_barrier_init(&run.done, NULL, threads + 1);
+	pthread_barrier_init(&run.release, NULL, threads + 1);
+
+	run.shared = bench_create(&run);
+
+	live_bytes = 0;
+	peak_bytes = 0;
+	rss_before = rss_kb();
+
+	for (int i = 0; i < threads; i++)
+		pthread_create(&tids[i], NULL, bench_thread, &run);
+
+	pthread_barrier_wait(&run.start);
+	t = now_ns();
+	pthread_barrier_wait(&run.done);
+	t = now_ns() - t;
+	rss_full = rss_kb();
+	pthread_barrier_wait(&run.release);
+
+	for (int i = 0; i < threads; i++)
+		pthread_join(tids[i], NULL);
+
+	if (run.shared)
+		bench_free(run.shared);
+
+	printf("%s %dx%d format 0x%x usage 0x%x, %d thread%s, %d iterations each\n",
+		wl->name, wl->width, wl->height, wl->format, run.usage,
+		threads, threads > 1 ? "s" : "", iterations);
+	printf("  %-16s %10s %10s %10s\n", "op", "p50 us", "p99 us", "count");
+	for (int op = 0; op < OP_COUNT; op++) {
+		if (run.samples[op].empty())
+			continue;
+		printf("  %-16s %10.1f %10.1f %10zu\n", op_names[op],
+			percentile(run.samples[op], 50),
+			percentile(run.samples[op], 99),
+			run.samples[op].size());
+	}
+	printf("  %.0f buffers/s, peak %lld KiB in buffers, RSS +%ld KiB, %d errors\n\n",
+		(double)run.samples[OP_CREATE].size() * 1e9 / (t ? t : 1),
+		(long long)(peak_bytes >> 10), rss_full - rss_before, run.errors);
+
+	pthread_barrier_destroy(&run.start);
+	pthread_barrier_destroy(&run.done);
+	pthread_barrier_destroy(&run.release);
+	pthread_mutex_destroy(&run.mutex);
+}
+
+static std::vector<std::string> split(const char *list)
+{
+	std::vector<std::string> out;
+	std::string cur;
+
+	for (const char *p = list; ; p++) {
+		if (*p == ',' || !*p) {
+			if (!cur.empty())
+				out.push_back(cur);
+			cur.clear();
+			if (!*p)
+				break;
+		} else {
+			cur += *p;
+		}
+	}
+
+	return out;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-d node | -s] [-w ui,video,cursor,camera] [-t 1,2,4,8]\n"
+		"          [-n iterations] [-q depth] [-m often|rarely] [-f]\n"
+		"  -d  render node to allocate from, e.g. a vgem node\n"
+		"  -s  use the memfd/udmabuf software backend\n"
+		"  -w  workloads to run\n"
+		"  -t  thread counts to run each workload with\n"
+		"  -n  buffers allocated per thread\n"
+		"  -q  buffers each thread keeps alive\n"
+		"  -m  force *_OFTEN or *_RARELY CPU usage on every workload\n"
+		"  -f  write the whole buffer while it is locked\n", prog);
+}
+
+int main(int argc, char **argv)
+{
+	const char *node = NULL;
+	const char *wl_list = "ui,video,cursor,camera";
+	const char *thread_list = "1,2,4,8";
+	bool soft = false;
+	char dump[4096];
+	int opt;
+
+	while ((opt = getopt(argc, argv, "d:sw:t:n:q:m:fh")) != -1) {
+		switch (opt) {
+		case 'd':
+			node = optarg;
+			break;
+		case 's':
+			soft = true;
+			break;
+		case 'w':
+			wl_list = optarg;
+			break;
+		case 't':
+			thread_list = optarg;
+			break;
+		case 'n':
+			iterations = atoi(optarg);
+			break;
+		case 'q':
+			depth = atoi(optarg);
+			break;
+		case 'm':
+			if (!strcmp(optarg, "often")) {
+				sw_override = GRALLOC_USAGE_SW_READ_OFTEN |
+					GRALLOC_USAGE_SW_WRITE_OFTEN;
+			} else if (!strcmp(optarg, "rarely")) {
+				sw_override = GRALLOC_USAGE_SW_READ_RARELY |
+					GRALLOC_USAGE_SW_WRITE_RARELY;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'f':
+			fill = true;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (iterations <= 0 || depth < 0) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	if (node) {
+		int fd = open(node, O_RDWR | O_CLOEXEC);
+
+		if (fd < 0 || !(bench_gbm = gbm_create_device(fd))) {
+			fprintf(stderr, "cannot create a gbm device on %s\n", node);
+			return 1;
+		}
+	} else if (!soft) {
+		bench_gbm = gbm_dev_create();
+		if (!bench_gbm)
+			fprintf(stderr, "no gbm device, using the software backend\n");
+	}
+
+	printf("backend: %s\n\n", bench_gbm ? "gbm" : "software");
+
+	for (const std::string &name : split(wl_list)) {
+		const struct workload *wl = NULL;
+
+		for (const struct workload &w : workloads)
+			if (name == w.name)
+				wl = &w;
+		if (!wl) {
+			fprintf(stderr, "unknown workload %s\n", name.c_str());
+			return 1;
+		}
+
+		for (const std::string &threads : split(thread_list))
+			if (atoi(threads.c_str()) > 0)
+				bench_workload(wl, atoi(threads.c_str()));
+	}
+
+	if (bench_gbm) {
+		gralloc_gbm_dump(dump, sizeof(dump));
+		printf("%s", dump);
+		gbm_dev_destroy(bench_gbm);
+	}
+
+	return 0;
+}
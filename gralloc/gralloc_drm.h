@@ -24,6 +24,8 @@
 #ifndef _GRALLOC_DRM_H_
 #define _GRALLOC_DRM_H_
 
+#include <stdint.h>
+
 #ifdef __cplusplus
 extern "C" {
 #endif
@@ -34,6 +36,42 @@ enum {
 	 *	   int *fd);
 	 */
 	GRALLOC_MODULE_PERFORM_GET_DRM_FD                = 0x40000002,
+	/* perform(const struct gralloc_module_t *mod,
+	 *	   int op,
+	 *	   struct gralloc_gbm_alloc_stats *stats);
+	 */
+	GRALLOC_MODULE_PERFORM_GET_ALLOC_STATS           = 0x40000004,
+	/* perform(const struct gralloc_module_t *mod,
+	 *	   int op,
+	 *	   struct gralloc_gbm_buffer_info *buffers,
+	 *	   uint32_t *count);
+	 *
+	 * Fills in at most *count buffers and sets *count to the number of
+	 * live buffers.
+	 */
+	GRALLOC_MODULE_PERFORM_GET_BUFFER_INVENTORY      = 0x40000005,
+};
+
+struct gralloc_gbm_alloc_stats {
+	uint64_t live_count;	/* buffers allocated and not freed yet */
+	uint64_t live_bytes;	/* memory held by those buffers */
+	uint64_t peak_bytes;	/* highest live_bytes so far */
+	uint64_t allocs;	/* successful allocations */
+	uint64_t alloc_failures;
+	uint64_t frees;
+	uint64_t uptime_ns;	/* time covered by the counters, for rates */
+	uint64_t locks;		/* lock and lock_ycbcr calls */
+	uint64_t mapped_ns;	/* time buffers spent locked for CPU access */
+};
+
+struct gralloc_gbm_buffer_info {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t usage;
+	uint64_t modifier;
+	uint64_t size;
+	uint64_t age_ns;	/* time since the buffer was allocated */
 };
 
 #ifdef __cplusplus
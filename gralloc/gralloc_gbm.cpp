@@ -23,10 +23,12 @@
  */
 
 #define LOG_TAG "GRALLOC-GBM"
+#define ATRACE_TAG ATRACE_TAG_GRAPHICS
 
 #include <log/log.h>
 #include <cutils/atomic.h>
 #include <cutils/properties.h>
+#include <cutils/trace.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -35,35 +37,113 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <assert.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <linux/dma-buf.h>
 
 #include <hardware/gralloc.h>
 #include <system/graphics.h>
 
+#include <drm/drm_fourcc.h>
 #include <gbm.h>
 
+#include "gralloc_drm.h"
 #include "gralloc_gbm_priv.h"
+#include "gralloc_gbm_handle.h"
 #include <android/gralloc_handle.h>
 
+#include <atomic>
+#include <functional>
+#include <map>
 #include <unordered_map>
 #include <sstream>
 #include <vector>
 
 #define MAX(a, b) (((a) > (b)) ? (a) : (b))
+#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
 
 #define unlikely(x) __builtin_expect(!!(x), 0)
 
-static std::unordered_map<buffer_handle_t, struct gbm_bo *> gbm_bo_handle_map;
-static std::unordered_map<uint32_t, std::vector<uint64_t>> gbm_format_modifiers_map;
+/*
+ * Handles are spread over several independently locked tables, so that
+ * lookups from lock/unlock on one thread do not wait for registration or
+ * allocation on another.
+ */
+#define HANDLE_SHARDS 16
+
+struct handle_shard {
+	pthread_rwlock_t lock;
+	std::unordered_map<buffer_handle_t, struct gbm_bo *> map;
+
+	handle_shard() { pthread_rwlock_init(&lock, NULL); }
+};
+
+static struct handle_shard handle_shards[HANDLE_SHARDS];
+
+/*
+ * Modifiers the compositor advertised for a format. Multi-plane ones keep
+ * compression metadata (CCS, DCC) in planes after the first.
+ */
+struct format_modifiers {
+	std::vector<uint64_t> single_plane;
+	std::vector<uint64_t> all;
+};
 
+static pthread_mutex_t modifiers_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<uint32_t, struct format_modifiers> gbm_format_modifiers_map;
+
+/*
+ * Which modifiers a buffer may use, decided by who accesses it.
+ */
+enum modifier_policy {
+	MODIFIER_POLICY_LINEAR,	/* mapped by the CPU */
+	MODIFIER_POLICY_SHARED,	/* imported by the compositor or another device */
+	MODIFIER_POLICY_GPU,	/* only used by the GPU */
+	MODIFIER_POLICY_COUNT,
+};
+
+static const char *modifier_policy_names[MODIFIER_POLICY_COUNT] = {
+	"linear", "shared", "gpu",
+};
+
+/* number of BOs created per policy and modifier */
+static pthread_mutex_t modifier_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::pair<int, uint64_t>, uint64_t> modifier_stats;
+
+/*
+ * gbm_bo_map and gbm_bo_unmap go through a context shared by the whole gbm
+ * device, which must not be used from two threads at once.
+ */
+static pthread_mutex_t gbm_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Per-BO state, guarded by its own lock. It is attached when the BO is
+ * created or imported, and lives as long as the BO.
+ */
 struct bo_data_t {
-	void *map_data;
+	pthread_mutex_t lock;
+	/* gbm_bo_map cookies of the outstanding CPU locks, newest last */
+	std::vector<void *> maps;
 	int lock_count;
 	int locked_for;
+
+	/* persistent mapping of the dma-buf, see gbm_cpu_map */
+	void *cpu_addr;
+	size_t cpu_size;
+	bool cpu_map_failed;
+
+	/* start of the current CPU access, for gralloc_gbm_stats_mapped */
+	int64_t mapped_since;
 };
 
 void gralloc_gbm_destroy_user_data(struct gbm_bo *bo, void *data)
 {
 	struct bo_data_t *bo_data = (struct bo_data_t *)data;
+	if (bo_data->cpu_addr)
+		munmap(bo_data->cpu_addr, bo_data->cpu_size);
+	pthread_mutex_destroy(&bo_data->lock);
 	delete bo_data;
 
 	(void)bo;
@@ -73,14 +153,290 @@ static struct bo_data_t *gbm_bo_data(struct gbm_bo *bo) {
 	return (struct bo_data_t *)gbm_bo_get_user_data(bo);
 }
 
+static void gbm_bo_attach_data(struct gbm_bo *bo)
+{
+	struct bo_data_t *bo_data = new struct bo_data_t();
+
+	pthread_mutex_init(&bo_data->lock, NULL);
+	gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
+}
+
+static struct handle_shard *get_handle_shard(buffer_handle_t handle)
+{
+	return &handle_shards[std::hash<buffer_handle_t>()(handle) % HANDLE_SHARDS];
+}
+
+static bool handle_table_insert(buffer_handle_t handle, struct gbm_bo *bo)
+{
+	struct handle_shard *shard = get_handle_shard(handle);
+	bool inserted;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	inserted = shard->map.emplace(handle, bo).second;
+	pthread_rwlock_unlock(&shard->lock);
+
+	return inserted;
+}
+
+static struct gbm_bo *handle_table_remove(buffer_handle_t handle)
+{
+	struct handle_shard *shard = get_handle_shard(handle);
+	struct gbm_bo *bo = NULL;
+
+	pthread_rwlock_wrlock(&shard->lock);
+	auto it = shard->map.find(handle);
+	if (it != shard->map.end()) {
+		bo = it->second;
+		shard->map.erase(it);
+	}
+	pthread_rwlock_unlock(&shard->lock);
+
+	return bo;
+}
+
+static pthread_once_t bo_prefault_once = PTHREAD_ONCE_INIT;
+static bool bo_prefault_enabled;
 
-static std::vector<uint64_t> get_supported_modifiers(struct gbm_device *gbm, uint32_t format) {
-	if (gbm_format_modifiers_map.find(format) != gbm_format_modifiers_map.end()) {
-		return gbm_format_modifiers_map[format];
+static int64_t gbm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void bo_prefault_init(void)
+{
+	bo_prefault_enabled = property_get_bool("gralloc.gbm.prefault", false);
+}
+
+/*
+ * Populate the pages of a CPU-visible BO up front, so that the page clear
+ * happens here rather than on the first lock in the client.
+ */
+static void bo_prefault(struct gbm_bo *bo, int fd)
+{
+	size_t size = (size_t)gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
+	void *addr;
+
+	addr = mmap(NULL, size, PROT_READ, MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (addr != MAP_FAILED)
+		munmap(addr, size);
+}
+
+/*
+ * Buffers handed out by this process, whichever backend allocated them,
+ * and how they are used. Lock counters also cover imported buffers.
+ */
+struct alloc_record {
+	uint32_t width;
+	uint32_t height;
+	uint32_t format;
+	uint32_t usage;
+	uint64_t modifier;
+	uint64_t size;
+	int64_t created_ns;
+};
+
+static pthread_mutex_t alloc_stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<buffer_handle_t, alloc_record> alloc_live;
+static struct gralloc_gbm_alloc_stats alloc_stats;
+static const int64_t alloc_stats_start_ns = gbm_now_ns();
+static uint64_t alloc_stats_dumped_allocs;
+static int64_t alloc_stats_dumped_ns = alloc_stats_start_ns;
+static std::atomic<uint64_t> alloc_stats_locks;
+static std::atomic<uint64_t> alloc_stats_mapped_ns;
+
+/*
+ * Account a successful allocation, or a failed one when handle is NULL.
+ */
+void gralloc_gbm_stats_alloc(buffer_handle_t handle)
+{
+	struct gralloc_handle_t *hnd;
+	struct alloc_record record;
+	off_t size;
+
+	if (!handle) {
+		pthread_mutex_lock(&alloc_stats_mutex);
+		alloc_stats.alloc_failures++;
+		pthread_mutex_unlock(&alloc_stats_mutex);
+		return;
+	}
+
+	hnd = gralloc_handle(handle);
+	size = lseek(hnd->prime_fd, 0, SEEK_END);
+
+	record.width = hnd->width;
+	record.height = hnd->height;
+	record.format = hnd->format;
+	record.usage = hnd->usage;
+	record.modifier = hnd->modifier;
+	record.size = size > 0 ? size : 0;
+	record.created_ns = gbm_now_ns();
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+	if (alloc_live.emplace(handle, record).second) {
+		alloc_stats.allocs++;
+		alloc_stats.live_count++;
+		alloc_stats.live_bytes += record.size;
+		alloc_stats.peak_bytes = MAX(alloc_stats.peak_bytes, alloc_stats.live_bytes);
+	}
+	ATRACE_INT64("gralloc live bytes", alloc_stats.live_bytes);
+	ATRACE_INT64("gralloc live buffers", alloc_stats.live_count);
+	pthread_mutex_unlock(&alloc_stats_mutex);
+}
+
+void gralloc_gbm_stats_free(buffer_handle_t handle)
+{
+	pthread_mutex_lock(&alloc_stats_mutex);
+	auto it = alloc_live.find(handle);
+	if (it != alloc_live.end()) {
+		alloc_stats.frees++;
+		alloc_stats.live_count--;
+		alloc_stats.live_bytes -= it->second.size;
+		alloc_live.erase(it);
+	}
+	ATRACE_INT64("gralloc live bytes", alloc_stats.live_bytes);
+	ATRACE_INT64("gralloc live buffers", alloc_stats.live_count);
+	pthread_mutex_unlock(&alloc_stats_mutex);
+}
+
+/*
+ * Count a lock. Returns the time to hand back to gralloc_gbm_stats_mapped
+ * once the last CPU lock of the buffer is released.
+ */
+int64_t gralloc_gbm_stats_lock(void)
+{
+	alloc_stats_locks++;
+
+	return gbm_now_ns();
+}
+
+void gralloc_gbm_stats_mapped(int64_t since)
+{
+	alloc_stats_mapped_ns += gbm_now_ns() - since;
+}
+
+void gralloc_gbm_get_alloc_stats(struct gralloc_gbm_alloc_stats *stats)
+{
+	pthread_mutex_lock(&alloc_stats_mutex);
+	*stats = alloc_stats;
+	pthread_mutex_unlock(&alloc_stats_mutex);
+
+	stats->uptime_ns = gbm_now_ns() - alloc_stats_start_ns;
+	stats->locks = alloc_stats_locks;
+	stats->mapped_ns = alloc_stats_mapped_ns;
+}
+
+/*
+ * Describe up to count live buffers. Returns how many there are in total.
+ */
+uint32_t gralloc_gbm_get_inventory(struct gralloc_gbm_buffer_info *buffers,
+		uint32_t count)
+{
+	int64_t now = gbm_now_ns();
+	uint32_t n = 0;
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+	for (const auto &it : alloc_live) {
+		if (n < count) {
+			struct gralloc_gbm_buffer_info *info = &buffers[n];
+
+			info->width = it.second.width;
+			info->height = it.second.height;
+			info->format = it.second.format;
+			info->usage = it.second.usage;
+			info->modifier = it.second.modifier;
+			info->size = it.second.size;
+			info->age_ns = now - it.second.created_ns;
+		}
+		n++;
+	}
+	pthread_mutex_unlock(&alloc_stats_mutex);
+
+	return n;
+}
+
+/*
+ * Describe the live buffers and the modifiers chosen so far, for
+ * dumpsys. Buffers are summarized by format and usage, the whole dump has
+ * to fit in the few KiB dumpsys hands us.
+ */
+void gralloc_gbm_dump(char *buff, int buff_len)
+{
+	struct gralloc_gbm_alloc_stats allocs;
+	std::map<uint32_t, std::pair<uint64_t, uint64_t>> by_format, by_usage;
+	std::stringstream out;
+	int64_t now = gbm_now_ns();
+	double rate;
+
+	gralloc_gbm_get_alloc_stats(&allocs);
+
+	pthread_mutex_lock(&alloc_stats_mutex);
+	for (const auto &it : alloc_live) {
+		by_format[it.second.format].first++;
+		by_format[it.second.format].second += it.second.size;
+		by_usage[it.second.usage].first++;
+		by_usage[it.second.usage].second += it.second.size;
+	}
+	rate = (double)(allocs.allocs - alloc_stats_dumped_allocs) * 1e9 /
+		MAX(now - alloc_stats_dumped_ns, 1);
+	alloc_stats_dumped_allocs = allocs.allocs;
+	alloc_stats_dumped_ns = now;
+	pthread_mutex_unlock(&alloc_stats_mutex);
+
+	out << "GBM gralloc:\n";
+	out << "  live: " << allocs.live_count << " buffers, "
+	    << (allocs.live_bytes >> 10) << " KiB, peak "
+	    << (allocs.peak_bytes >> 10) << " KiB\n";
+	out << "  allocations: " << allocs.allocs << " (" << allocs.alloc_failures
+	    << " failed), " << allocs.frees << " frees, " << rate
+	    << "/s since last dump\n";
+	out << "  locks: " << allocs.locks << ", " << (allocs.mapped_ns / 1000000)
+	    << " ms mapped\n";
+
+	out << "  by format:\n";
+	for (const auto &it : by_format) {
+		out << "    0x" << std::hex << it.first << std::dec << ": "
+		    << it.second.first << " buffers, " << (it.second.second >> 10)
+		    << " KiB\n";
+	}
+	out << "  by usage:\n";
+	for (const auto &it : by_usage) {
+		out << "    0x" << std::hex << it.first << std::dec << ": "
+		    << it.second.first << " buffers, " << (it.second.second >> 10)
+		    << " KiB\n";
+	}
+
+	out << "  modifiers chosen:\n";
+	pthread_mutex_lock(&modifier_stats_mutex);
+	for (const auto &it : modifier_stats) {
+		out << "    " << modifier_policy_names[it.first.first] << " 0x"
+		    << std::hex << it.first.second << std::dec << ": "
+		    << it.second << "\n";
+	}
+	pthread_mutex_unlock(&modifier_stats_mutex);
+
+	if (buff_len > 0) {
+		strncpy(buff, out.str().c_str(), buff_len - 1);
+		buff[buff_len - 1] = '\0';
+	}
+}
+
+
+static std::vector<uint64_t> get_supported_modifiers(struct gbm_device *gbm,
+		uint32_t format, bool multi_plane) {
+	pthread_mutex_lock(&modifiers_mutex);
+	auto cached = gbm_format_modifiers_map.find(format);
+	if (cached != gbm_format_modifiers_map.end()) {
+		std::vector<uint64_t> modifiers = multi_plane ?
+			cached->second.all : cached->second.single_plane;
+		pthread_mutex_unlock(&modifiers_mutex);
+		return modifiers;
 	}
 
 	// Create empty default so we can match it next time
-	std::vector<uint64_t> &modifiers = gbm_format_modifiers_map[format];
+	struct format_modifiers &modifiers = gbm_format_modifiers_map[format];
 
 	std::stringstream prop_name_stream;
 	prop_name_stream << "waydroid.modifiers." << std::hex << format << ".";
@@ -95,13 +451,45 @@ static std::vector<uint64_t> get_supported_modifiers(struct gbm_device *gbm, uin
 		uint64_t mod;
 		ss >> std::hex >> mod;
 
-		// Filter out multiplanar format-modifier combos
+		modifiers.all.push_back(mod);
 		if (gbm_device_get_format_modifier_plane_count(gbm, format, mod) < 2)
-			modifiers.push_back(mod);
+			modifiers.single_plane.push_back(mod);
 		i++;
 	}
 
-	return modifiers;
+	std::vector<uint64_t> result = multi_plane ? modifiers.all : modifiers.single_plane;
+	pthread_mutex_unlock(&modifiers_mutex);
+
+	return result;
+}
+
+/*
+ * Buffers the CPU maps are linear, so that locking them needs no detiling.
+ * Buffers the compositor imports stick to single-plane modifiers, as the
+ * HWC hands it one plane. Buffers only the GPU touches may also use
+ * multi-plane modifiers, which is where compression lives.
+ */
+static enum modifier_policy get_modifier_policy(int usage, int bind)
+{
+	if (bind & GBM_BO_USE_LINEAR)
+		return MODIFIER_POLICY_LINEAR;
+
+	if (usage & (GRALLOC_USAGE_HW_COMPOSER |
+		     GRALLOC_USAGE_HW_FB |
+		     GRALLOC_USAGE_CURSOR |
+		     GRALLOC_USAGE_HW_VIDEO_ENCODER |
+		     GRALLOC_USAGE_HW_CAMERA_WRITE |
+		     GRALLOC_USAGE_HW_CAMERA_READ))
+		return MODIFIER_POLICY_SHARED;
+
+	return MODIFIER_POLICY_GPU;
+}
+
+static void record_modifier_choice(enum modifier_policy policy, uint64_t modifier)
+{
+	pthread_mutex_lock(&modifier_stats_mutex);
+	modifier_stats[std::make_pair((int)policy, modifier)]++;
+	pthread_mutex_unlock(&modifier_stats_mutex);
 }
 
 static uint32_t get_gbm_format(int format)
@@ -130,19 +518,13 @@ static uint32_t get_gbm_format(int format)
 		else
 			fmt = GBM_FORMAT_ARGB8888;
 		break;
-	case HAL_PIXEL_FORMAT_YV12:
-		/* YV12 is planar, but must be a single buffer so ask for GR88 */
-		fmt = GBM_FORMAT_GR88;
-		break;
 	case HAL_PIXEL_FORMAT_RGBA_FP16:
 		fmt = GBM_FORMAT_ABGR16161616F;
 		break;
 	case HAL_PIXEL_FORMAT_RGBA_1010102:
 		fmt = GBM_FORMAT_ABGR2101010;
 		break;
-	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
-	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-	case HAL_PIXEL_FORMAT_YCbCr_420_888:
+	/* planar formats are described by planar_formats */
 	default:
 		fmt = 0;
 		break;
@@ -151,7 +533,43 @@ static uint32_t get_gbm_format(int format)
 	return fmt;
 }
 
-static int gralloc_gbm_get_bpp(int format)
+/*
+ * Multi-planar YUV formats. GBM is asked for the format itself first, with
+ * every plane in a single BO. Drivers that cannot allocate it get a linear
+ * single-plane container with the planes laid out by hand.
+ */
+struct planar_format_t {
+	int hal_format;
+	uint32_t fourcc;
+	uint32_t container;	/* single-plane GBM format of the fallback */
+	int cpp;		/* bytes per luma sample */
+	int chroma_div;		/* luma rows per chroma row */
+	bool native;		/* whether to ask GBM for fourcc first */
+};
+
+static const struct planar_format_t planar_formats[] = {
+	{ HAL_PIXEL_FORMAT_YCbCr_420_888, GBM_FORMAT_NV12, GBM_FORMAT_R8, 1, 2, true },
+	{ HAL_PIXEL_FORMAT_YCrCb_420_SP, GBM_FORMAT_NV21, GBM_FORMAT_R8, 1, 2, true },
+	{ HAL_PIXEL_FORMAT_YCbCr_422_SP, GBM_FORMAT_NV16, GBM_FORMAT_R8, 1, 1, true },
+	/* Android fixes the YV12 layout, so it is always laid out by hand */
+	{ HAL_PIXEL_FORMAT_YV12, GBM_FORMAT_YVU420, GBM_FORMAT_R8, 1, 2, false },
+	{ HAL_PIXEL_FORMAT_YCBCR_P010, DRM_FORMAT_P010, GBM_FORMAT_GR88, 2, 2, true },
+};
+
+/* planar_formats entries the driver could not allocate natively */
+static std::atomic<uint32_t> planar_native_failed;
+
+static const struct planar_format_t *get_planar_format(int format)
+{
+	for (size_t i = 0; i < sizeof(planar_formats) / sizeof(planar_formats[0]); i++) {
+		if (planar_formats[i].hal_format == format)
+			return &planar_formats[i];
+	}
+
+	return NULL;
+}
+
+int gralloc_gbm_get_bpp(int format)
 {
 	int bpp;
 
@@ -173,6 +591,9 @@ static int gralloc_gbm_get_bpp(int format)
 		bpp = 2;
 		break;
 	/* planar; only Y is considered */
+	case HAL_PIXEL_FORMAT_YCBCR_P010:
+		bpp = 2;
+		break;
 	case HAL_PIXEL_FORMAT_YV12:
 	case HAL_PIXEL_FORMAT_YCbCr_422_SP:
 	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
@@ -210,30 +631,42 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 {
 	struct gbm_bo *bo;
 	struct gralloc_handle_t *handle = gralloc_handle(_handle);
+	struct gralloc_gbm_handle_t *gbm_handle = gralloc_gbm_handle(_handle);
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
 	struct gbm_import_fd_modifier_data data;
 	#else
 	struct gbm_import_fd_data data;
 	#endif
 
-	int format = get_gbm_format(handle->format);
 	if (handle->prime_fd < 0)
 		return NULL;
 
 	memset(&data, 0, sizeof(data));
-	data.width = handle->width;
-	data.height = handle->height;
-	data.format = format;
-	/* Adjust the width and height for a GBM GR88 buffer */
-	if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-		data.width /= 2;
-		data.height += handle->height / 2;
+	if (gbm_handle) {
+		/* import the BO as it was allocated, planar or container */
+		data.width = gbm_handle->bo_width;
+		data.height = gbm_handle->bo_height;
+		data.format = gbm_handle->bo_format;
+	} else {
+		data.width = handle->width;
+		data.height = handle->height;
+		data.format = get_gbm_format(handle->format);
 	}
 
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
-	data.num_fds = 1;
-	data.fds[0] = handle->prime_fd;
-	data.strides[0] = handle->stride;
+	if (gbm_handle && gbm_handle->bo_format == gbm_handle->drm_format &&
+	    gbm_handle->num_planes > 1) {
+		data.num_fds = gbm_handle->num_planes;
+		for (uint32_t i = 0; i < gbm_handle->num_planes; i++) {
+			data.fds[i] = handle->prime_fd;
+			data.strides[i] = gbm_handle->strides[i];
+			data.offsets[i] = gbm_handle->offsets[i];
+		}
+	} else {
+		data.num_fds = 1;
+		data.fds[0] = handle->prime_fd;
+		data.strides[0] = handle->stride;
+	}
 	data.modifier = handle->modifier;
 	bo = gbm_bo_import(gbm, GBM_BO_IMPORT_FD_MODIFIER, &data, 0);
 	#else
@@ -245,14 +678,36 @@ static struct gbm_bo *gbm_import(struct gbm_device *gbm,
 	return bo;
 }
 
-static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
-		buffer_handle_t _handle)
+/*
+ * Whether every plane of the BO lives in the same buffer, which is what a
+ * handle with a single prime_fd can describe.
+ */
+static bool gbm_bo_single_buffer(struct gbm_bo *bo)
+{
+	int planes = gbm_bo_get_plane_count(bo);
+	uint32_t handle = gbm_bo_get_handle_for_plane(bo, 0).u32;
+
+	if (planes > GRALLOC_GBM_MAX_PLANES)
+		return false;
+
+	for (int i = 1; i < planes; i++) {
+		if (gbm_bo_get_handle_for_plane(bo, i).u32 != handle)
+			return false;
+	}
+
+	return true;
+}
+
+static struct gbm_bo *gbm_alloc_bo(struct gbm_device *gbm,
+		struct gralloc_handle_t *handle, const struct planar_format_t *planar,
+		bool native)
 {
 	struct gbm_bo *bo = NULL;
-	struct gralloc_handle_t *handle = gralloc_handle(_handle);
 	int format = get_gbm_format(handle->format);
 	int usage = get_pipe_bind(handle->usage);
+	enum modifier_policy policy;
 	int width, height;
+	std::vector<uint64_t> modifiers;
 
 	width = handle->width;
 	height = handle->height;
@@ -263,48 +718,264 @@ static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
 			height = 64;
 	}
 
-	/*
-	 * For YV12, we request GR88, so halve the width since we're getting
-	 * 16bpp. Then increase the height by 1.5 for the U and V planes.
-	 */
-	if (handle->format == HAL_PIXEL_FORMAT_YV12) {
-		width /= 2;
-		height += handle->height / 2;
+	if (planar && native) {
+		format = planar->fourcc;
+		/* planar BOs are only CPU mapped through their dma-buf */
+		if (handle->usage & (GRALLOC_USAGE_SW_READ_MASK | GRALLOC_USAGE_SW_WRITE_MASK))
+			usage |= GBM_BO_USE_LINEAR;
+	} else if (planar) {
+		/*
+		 * Room for the chroma planes below the luma plane. YV12 wants its
+		 * chroma stride to be half the luma stride, aligned to 16.
+		 */
+		format = planar->container;
+		if (planar->fourcc == GBM_FORMAT_YVU420)
+			width = GRALLOC_ALIGN(width, 32);
+		height += (height + planar->chroma_div - 1) / planar->chroma_div;
+		usage |= GBM_BO_USE_LINEAR;
 	}
 
+	policy = get_modifier_policy(handle->usage, usage);
+	if (!planar && policy != MODIFIER_POLICY_LINEAR)
+		modifiers = get_supported_modifiers(gbm, format,
+						    policy == MODIFIER_POLICY_GPU);
+
 	ALOGV("create BO, size=%dx%d, fmt=%d, usage=%x",
 	      handle->width, handle->height, handle->format, usage);
-	std::vector<uint64_t> modifiers = get_supported_modifiers(gbm, format);
 	if (modifiers.size() > 0) {
 		bo = gbm_bo_create_with_modifiers2(gbm, width, height, format, modifiers.data(), modifiers.size(), usage);
+		if (bo && !gbm_bo_single_buffer(bo)) {
+			gbm_bo_destroy(bo);
+			bo = NULL;
+		}
 	}
 	if (!bo) {
 		ALOGV("fallback to gbm_bo_create without modifiers");
 		bo = gbm_bo_create(gbm, width, height, format, usage);
 	}
+	if (bo && !gbm_bo_single_buffer(bo)) {
+		gbm_bo_destroy(bo);
+		bo = NULL;
+	}
 	if (!bo) {
+		if (native) {
+			ALOGV("no native planar BO, fmt=%d", handle->format);
+			return NULL;
+		}
 		ALOGE("failed to create BO, size=%dx%d, fmt=%d, usage=%x",
 		      handle->width, handle->height, handle->format, usage);
 		return NULL;
 	}
 
+	gbm_bo_attach_data(bo);
+
 	handle->prime_fd = gbm_bo_get_fd(bo);
 	handle->stride = gbm_bo_get_stride(bo);
 	#ifdef GBM_BO_IMPORT_FD_MODIFIER
 	handle->modifier = gbm_bo_get_modifier(bo);
 	#endif
+	record_modifier_choice(policy, handle->modifier);
+
+	if (bo_prefault_enabled && (usage & GBM_BO_USE_LINEAR) && handle->prime_fd >= 0)
+		bo_prefault(bo, handle->prime_fd);
 
 	return bo;
 }
 
+/*
+ * Lay out the planes of a planar format in a single-plane container of
+ * bo_height rows, the way the rest of gralloc expects them.
+ */
+static int fill_container_layout(struct gralloc_gbm_handle_t *handle,
+		const struct planar_format_t *planar, uint32_t stride)
+{
+	uint32_t height = handle->base.height;
+	uint32_t end;
+
+	handle->drm_format = planar->fourcc;
+	handle->strides[0] = stride;
+	handle->offsets[1] = stride * height;
+	if (planar->fourcc == GBM_FORMAT_YVU420) {
+		uint32_t cstride = GRALLOC_ALIGN(stride / 2, 16);
+
+		handle->num_planes = 3;
+		handle->strides[1] = cstride;
+		handle->offsets[2] = handle->offsets[1] + cstride * (height / 2);
+		handle->strides[2] = cstride;
+		end = handle->offsets[2] + cstride * (height / 2);
+		if (stride % 16)
+			end = UINT32_MAX;
+	} else {
+		handle->num_planes = 2;
+		handle->strides[1] = stride;
+		end = handle->offsets[1] +
+		      stride * ((height + planar->chroma_div - 1) / planar->chroma_div);
+	}
+
+	if (end > stride * handle->bo_height) {
+		ALOGE("cannot lay out fmt=%d in a %ux%u BO with stride %u",
+		      handle->base.format, handle->bo_width, handle->bo_height, stride);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Describe the planes of the BO in the handle.
+ */
+static int gbm_fill_layout(struct gralloc_gbm_handle_t *handle,
+		struct gbm_bo *bo, const struct planar_format_t *planar)
+{
+	uint32_t format = gbm_bo_get_format(bo);
+
+	handle->bo_format = format;
+	handle->bo_width = gbm_bo_get_width(bo);
+	handle->bo_height = gbm_bo_get_height(bo);
+	memset(handle->offsets, 0, sizeof(handle->offsets));
+	memset(handle->strides, 0, sizeof(handle->strides));
+
+	if (planar && planar->fourcc != format)
+		return fill_container_layout(handle, planar, gbm_bo_get_stride(bo));
+
+	handle->drm_format = format;
+	handle->num_planes = gbm_bo_get_plane_count(bo);
+	for (uint32_t i = 0; i < handle->num_planes; i++) {
+		handle->offsets[i] = gbm_bo_get_offset(bo, i);
+		handle->strides[i] = gbm_bo_get_stride_for_plane(bo, i);
+	}
+
+	return 0;
+}
+
+/*
+ * Lay out a linear buffer without a gbm device, for the software backend.
+ * Returns the number of bytes it needs, or 0 for an unsupported format.
+ */
+uint64_t gralloc_gbm_linear_layout(buffer_handle_t _handle)
+{
+	struct gralloc_gbm_handle_t *handle = gralloc_gbm_handle(_handle);
+	const struct planar_format_t *planar;
+	uint32_t format, width, height, stride;
+	int cpp;
+
+	if (!handle)
+		return 0;
+
+	planar = get_planar_format(handle->base.format);
+	format = planar ? planar->container : get_gbm_format(handle->base.format);
+	cpp = planar ? planar->cpp : gralloc_gbm_get_bpp(handle->base.format);
+	if (!format || !cpp)
+		return 0;
+
+	width = handle->base.width;
+	height = handle->base.height;
+	if (planar)
+		height += (height + planar->chroma_div - 1) / planar->chroma_div;
+	stride = GRALLOC_ALIGN(width * cpp, 64);
+
+	handle->base.stride = stride;
+	handle->base.modifier = DRM_FORMAT_MOD_LINEAR;
+	handle->bo_format = format;
+	handle->bo_width = width;
+	handle->bo_height = height;
+	memset(handle->offsets, 0, sizeof(handle->offsets));
+	memset(handle->strides, 0, sizeof(handle->strides));
+
+	if (planar) {
+		if (fill_container_layout(handle, planar, stride))
+			return 0;
+	} else {
+		handle->drm_format = format;
+		handle->num_planes = 1;
+		handle->strides[0] = stride;
+	}
+
+	return (uint64_t)stride * height;
+}
+
+static struct gbm_bo *gbm_alloc(struct gbm_device *gbm,
+		buffer_handle_t _handle)
+{
+	struct gralloc_gbm_handle_t *handle = gralloc_gbm_handle(_handle);
+	const struct planar_format_t *planar = get_planar_format(handle->base.format);
+	uint32_t planar_bit = planar ? 1u << (planar - planar_formats) : 0;
+	struct gbm_bo *bo = NULL;
+
+	if (planar && planar->native && !(planar_native_failed & planar_bit)) {
+		bo = gbm_alloc_bo(gbm, &handle->base, planar, true);
+		if (!bo) {
+			ALOGI("no native BOs for fmt=%d, using a single-plane layout",
+			      handle->base.format);
+			planar_native_failed |= planar_bit;
+		}
+	}
+	if (!bo)
+		bo = gbm_alloc_bo(gbm, &handle->base, planar, false);
+	if (!bo)
+		return NULL;
+
+	if (gbm_fill_layout(handle, bo, planar)) {
+		close(handle->base.prime_fd);
+		handle->base.prime_fd = -1;
+		gbm_bo_destroy(bo);
+		return NULL;
+	}
+
+	return bo;
+}
+
+/*
+ * Create a handle with room for the plane layout.
+ */
+native_handle_t *gralloc_gbm_handle_create(int width, int height,
+		int format, int usage)
+{
+	native_handle_t *nhandle;
+	struct gralloc_handle_t *handle;
+
+	nhandle = native_handle_create(GRALLOC_HANDLE_NUM_FDS,
+				       GRALLOC_GBM_HANDLE_NUM_INTS);
+	if (!nhandle)
+		return NULL;
+
+	memset(nhandle->data, 0,
+	       sizeof(int) * (GRALLOC_HANDLE_NUM_FDS + GRALLOC_GBM_HANDLE_NUM_INTS));
+
+	handle = gralloc_handle(nhandle);
+	handle->magic = GRALLOC_HANDLE_MAGIC;
+	handle->version = GRALLOC_HANDLE_VERSION;
+	handle->prime_fd = -1;
+	handle->width = width;
+	handle->height = height;
+	handle->format = format;
+	handle->usage = usage;
+
+	return nhandle;
+}
+
 void gbm_free(buffer_handle_t handle)
 {
-	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
+	struct gbm_bo *bo = handle_table_remove(handle);
+
+	if (!bo)
+		return;
+
+	gbm_bo_destroy(bo);
+}
+
+/*
+ * Free a bo created by gralloc_gbm_bo_create. The caller still closes and
+ * deletes the handle.
+ */
+void gralloc_gbm_bo_free(buffer_handle_t handle)
+{
+	struct gbm_bo *bo = handle_table_remove(handle);
 
 	if (!bo)
 		return;
 
-	gbm_bo_handle_map.erase(handle);
+	gralloc_gbm_stats_free(handle);
 	gbm_bo_destroy(bo);
 }
 
@@ -313,40 +984,162 @@ void gbm_free(buffer_handle_t handle)
  */
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle)
 {
-	return gbm_bo_handle_map[handle];
+	struct handle_shard *shard = get_handle_shard(handle);
+	struct gbm_bo *bo = NULL;
+
+	pthread_rwlock_rdlock(&shard->lock);
+	auto it = shard->map.find(handle);
+	if (it != shard->map.end())
+		bo = it->second;
+	pthread_rwlock_unlock(&shard->lock);
+
+	return bo;
 }
 
-static int gbm_map(buffer_handle_t handle, int enable_write, void **addr)
+/*
+ * Map the locked rectangle, so that drivers which map through a blit only
+ * transfer that region. The returned address is still relative to the
+ * buffer origin, as gralloc clients expect.
+ */
+static int gbm_map(struct gbm_bo *bo, struct gralloc_handle_t *handle,
+		int enable_write, int x, int y, int w, int h, void **addr)
 {
-	int err = 0;
 	int flags = GBM_BO_TRANSFER_READ;
-	struct gbm_bo *bo = gralloc_gbm_bo_from_handle(handle);
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
+	int bo_width = gbm_bo_get_width(bo);
+	int bo_height = gbm_bo_get_height(bo);
+	int cpp = gralloc_gbm_get_bpp(handle->format);
+	bool partial;
+	void *map_data = NULL;
 	uint32_t stride;
-
-	if (bo_data->map_data)
-		return -EINVAL;
+	void *ptr;
 
 	if (enable_write)
 		flags |= GBM_BO_TRANSFER_WRITE;
 
-	*addr = gbm_bo_map(bo, 0, 0, gbm_bo_get_width(bo), gbm_bo_get_height(bo),
-	                   flags, &stride, &bo_data->map_data);
-	ALOGV("mapped bo %p at %p", bo, *addr);
-	if (*addr == NULL)
+	/*
+	 * The rectangle of a planar format does not cover its chroma planes,
+	 * and one in another unit than the BO does not translate. Neither
+	 * does an empty or bogus one.
+	 */
+	partial = !get_planar_format(handle->format) &&
+		  cpp * 8 == (int)gbm_bo_get_bpp(bo) &&
+		  x >= 0 && y >= 0 && w > 0 && h > 0 &&
+		  x + w <= bo_width && y + h <= bo_height &&
+		  (x || y || w != bo_width || h != bo_height);
+	if (!partial) {
+		x = y = 0;
+		w = bo_width;
+		h = bo_height;
+	}
+
+	pthread_mutex_lock(&gbm_map_mutex);
+	ptr = gbm_bo_map(bo, x, y, w, h, flags, &stride, &map_data);
+	if (ptr && partial && stride != gbm_bo_get_stride(bo)) {
+		/* a staging copy cannot be addressed from the buffer origin */
+		gbm_bo_unmap(bo, map_data);
+		x = y = 0;
+		ptr = gbm_bo_map(bo, 0, 0, bo_width, bo_height,
+				 flags, &stride, &map_data);
+	}
+	pthread_mutex_unlock(&gbm_map_mutex);
+	ALOGV("mapped bo %p at %p", bo, ptr);
+	if (ptr == NULL)
 		return -ENOMEM;
 
 	assert(stride == gbm_bo_get_stride(bo));
 
-	return err;
+	bo_data->maps.push_back(map_data);
+	*addr = (char *)ptr - ((size_t)y * stride + (size_t)x * cpp);
+
+	return 0;
 }
 
 static void gbm_unmap(struct gbm_bo *bo)
 {
 	struct bo_data_t *bo_data = gbm_bo_data(bo);
 
-	gbm_bo_unmap(bo, bo_data->map_data);
-	bo_data->map_data = NULL;
+	if (bo_data->maps.empty())
+		return;
+
+	pthread_mutex_lock(&gbm_map_mutex);
+	gbm_bo_unmap(bo, bo_data->maps.back());
+	pthread_mutex_unlock(&gbm_map_mutex);
+	bo_data->maps.pop_back();
+}
+
+/*
+ * Linear buffers that the CPU accesses often are mapped once through their
+ * dma-buf and stay mapped for the life of the BO. Each lock then brackets
+ * the access with DMA_BUF_IOCTL_SYNC instead of going through gbm_bo_map,
+ * which maps, and for some drivers copies, the whole BO every time.
+ */
+static bool gbm_cpu_map_allowed(struct gralloc_handle_t *handle)
+{
+	struct gralloc_gbm_handle_t *gbm_handle = gralloc_gbm_handle(&handle->base);
+
+	/*
+	 * gbm_bo_map only reaches the first plane of a native planar BO, so
+	 * those always go through their dma-buf.
+	 */
+	bool native_planar = gbm_handle && get_planar_format(handle->format) &&
+			     gbm_handle->bo_format == gbm_handle->drm_format;
+
+	if (!native_planar &&
+	    (handle->usage & GRALLOC_USAGE_SW_READ_MASK) != GRALLOC_USAGE_SW_READ_OFTEN &&
+	    (handle->usage & GRALLOC_USAGE_SW_WRITE_MASK) != GRALLOC_USAGE_SW_WRITE_OFTEN)
+		return false;
+
+	return handle->prime_fd >= 0 &&
+	       (handle->modifier == DRM_FORMAT_MOD_LINEAR ||
+	        handle->modifier == DRM_FORMAT_MOD_INVALID);
+}
+
+static void *gbm_cpu_map(struct gbm_bo *bo, struct gralloc_handle_t *handle)
+{
+	struct bo_data_t *bo_data = gbm_bo_data(bo);
+	off_t size;
+	void *addr;
+
+	if (bo_data->cpu_addr || bo_data->cpu_map_failed)
+		return bo_data->cpu_addr;
+
+	size = lseek(handle->prime_fd, 0, SEEK_END);
+	if (size <= 0)
+		size = (off_t)gbm_bo_get_stride(bo) * gbm_bo_get_height(bo);
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+		    handle->prime_fd, 0);
+	if (addr == MAP_FAILED) {
+		ALOGV("cannot map dma-buf of bo %p: %s", bo, strerror(errno));
+		bo_data->cpu_map_failed = true;
+		return NULL;
+	}
+
+	bo_data->cpu_addr = addr;
+	bo_data->cpu_size = size;
+
+	return addr;
+}
+
+/*
+ * Bracket CPU access to a dma-buf. Errors are ignored, fds that are not
+ * dma-bufs (memfd) need no synchronization.
+ */
+void gbm_cpu_sync(int fd, int usage, bool end)
+{
+	struct dma_buf_sync sync;
+	int ret;
+
+	sync.flags = end ? DMA_BUF_SYNC_END : DMA_BUF_SYNC_START;
+	if (usage & GRALLOC_USAGE_SW_READ_MASK)
+		sync.flags |= DMA_BUF_SYNC_READ;
+	if (usage & GRALLOC_USAGE_SW_WRITE_MASK)
+		sync.flags |= DMA_BUF_SYNC_WRITE;
+
+	do {
+		ret = ioctl(fd, DMA_BUF_IOCTL_SYNC, &sync);
+	} while (ret && (errno == EINTR || errno == EAGAIN));
 }
 
 void gbm_dev_destroy(struct gbm_device *gbm)
@@ -389,14 +1182,20 @@ int gralloc_gbm_handle_register(buffer_handle_t _handle, struct gbm_device *gbm)
 	if (!_handle)
 		return -EINVAL;
 
-	if (gbm_bo_handle_map.count(_handle))
+	if (gralloc_gbm_bo_from_handle(_handle))
 		return -EINVAL;
 
 	bo = gbm_import(gbm, _handle);
 	if (!bo)
 		return -EINVAL;
 
-	gbm_bo_handle_map.emplace(_handle, bo);
+	gbm_bo_attach_data(bo);
+
+	/* lost a race against another registration of the same handle */
+	if (!handle_table_insert(_handle, bo)) {
+		gbm_bo_destroy(bo);
+		return -EINVAL;
+	}
 
 	return 0;
 }
@@ -420,17 +1219,21 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 	struct gbm_bo *bo;
 	native_handle_t *handle;
 
-	handle = gralloc_handle_create(width, height, format, usage);
+	pthread_once(&bo_prefault_once, bo_prefault_init);
+
+	handle = gralloc_gbm_handle_create(width, height, format, usage);
 	if (!handle)
 		return NULL;
 
 	bo = gbm_alloc(gbm, handle);
 	if (!bo) {
 		native_handle_delete(handle);
+		gralloc_gbm_stats_alloc(NULL);
 		return NULL;
 	}
 
-	gbm_bo_handle_map.emplace(handle, bo);
+	handle_table_insert(handle, bo);
+	gralloc_gbm_stats_alloc(handle);
 
 	/* in pixels */
 	*stride = gralloc_handle(handle)->stride / gralloc_gbm_get_bpp(format);
@@ -439,10 +1242,10 @@ buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 }
 
 /*
- * Lock a bo.  XXX thread-safety?
+ * Lock a bo.
  */
 int gralloc_gbm_bo_lock(buffer_handle_t handle,
-		int usage, int /*x*/, int /*y*/, int /*w*/, int /*h*/,
+		int usage, int x, int y, int w, int h,
 		void **addr)
 {
 	struct gralloc_handle_t *gbm_handle = gralloc_handle(handle);
@@ -468,39 +1271,50 @@ int gralloc_gbm_bo_lock(buffer_handle_t handle,
 	}
 
 	bo_data = gbm_bo_data(bo);
-	if (!bo_data) {
-		bo_data = new struct bo_data_t();
-		gbm_bo_set_user_data(bo, bo_data, gralloc_gbm_destroy_user_data);
-	}
+	pthread_mutex_lock(&bo_data->lock);
 
 	ALOGV("lock bo %p, cnt=%d, usage=%x", bo, bo_data->lock_count, usage);
 
 	/* allow multiple locks with compatible usages */
-	if (bo_data->lock_count && (bo_data->locked_for & usage) != usage)
+	if (bo_data->lock_count && (bo_data->locked_for & usage) != usage) {
+		pthread_mutex_unlock(&bo_data->lock);
 		return -EINVAL;
+	}
 
 	usage |= bo_data->locked_for;
 
 	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
 		     GRALLOC_USAGE_SW_READ_MASK)) {
-		/* the driver is supposed to wait for the bo */
-		int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
-		int err = gbm_map(handle, write, addr);
-		if (err)
-			return err;
+		if (gbm_cpu_map_allowed(gbm_handle) && gbm_cpu_map(bo, gbm_handle)) {
+			/* the sync ioctl waits for pending GPU access */
+			gbm_cpu_sync(gbm_handle->prime_fd, usage, false);
+			*addr = bo_data->cpu_addr;
+		} else {
+			/* the driver is supposed to wait for the bo */
+			int write = !!(usage & GRALLOC_USAGE_SW_WRITE_MASK);
+			int err = gbm_map(bo, gbm_handle, write, x, y, w, h, addr);
+			if (err) {
+				pthread_mutex_unlock(&bo_data->lock);
+				return err;
+			}
+		}
 	}
 	else {
 		/* kernel handles the synchronization here */
 	}
 
+	int64_t since = gralloc_gbm_stats_lock();
+	if (!bo_data->lock_count)
+		bo_data->mapped_since = since;
 	bo_data->lock_count++;
 	bo_data->locked_for |= usage;
+	pthread_mutex_unlock(&bo_data->lock);
 
 	return 0;
 }
 
 /*
- * Unlock a bo.
+ * Unlock a bo. Outstanding CPU locks are released newest first.
  */
 int gralloc_gbm_bo_unlock(buffer_handle_t handle)
 {
@@ -510,67 +1324,102 @@ int gralloc_gbm_bo_unlock(buffer_handle_t handle)
 		return -EINVAL;
 
 	bo_data = gbm_bo_data(bo);
+	pthread_mutex_lock(&bo_data->lock);
 
 	int mapped = bo_data->locked_for &
 		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
 
-	if (!bo_data->lock_count)
+	if (!bo_data->lock_count) {
+		pthread_mutex_unlock(&bo_data->lock);
 		return 0;
+	}
 
-	if (mapped)
+	if (mapped && bo_data->cpu_addr)
+		gbm_cpu_sync(gralloc_handle(handle)->prime_fd, mapped, true);
+	else if (mapped)
 		gbm_unmap(bo);
 
 	bo_data->lock_count--;
-	if (!bo_data->lock_count)
+	if (!bo_data->lock_count) {
+		if (mapped)
+			gralloc_gbm_stats_mapped(bo_data->mapped_since);
 		bo_data->locked_for = 0;
+	}
+	pthread_mutex_unlock(&bo_data->lock);
 
 	return 0;
 }
 
-#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
+/*
+ * Whether lock_ycbcr can describe the buffer.
+ */
+bool gralloc_gbm_has_ycbcr(buffer_handle_t handle)
+{
+	struct gralloc_gbm_handle_t *gbm_hnd = gralloc_gbm_handle(handle);
+	const struct planar_format_t *planar =
+		get_planar_format(gralloc_handle(handle)->format);
+
+	return planar && gbm_hnd && gbm_hnd->drm_format == planar->fourcc;
+}
+
+/*
+ * Fill in the planes of a buffer mapped at addr.
+ */
+void gralloc_gbm_get_ycbcr(buffer_handle_t handle, void *addr,
+		struct android_ycbcr *ycbcr)
+{
+	struct gralloc_gbm_handle_t *gbm_hnd = gralloc_gbm_handle(handle);
+	const struct planar_format_t *planar =
+		get_planar_format(gbm_hnd->base.format);
+	unsigned char *base = (unsigned char *)addr;
+
+	memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
+
+	ycbcr->y = base + gbm_hnd->offsets[0];
+	ycbcr->ystride = gbm_hnd->strides[0];
+	ycbcr->cstride = gbm_hnd->strides[1];
+
+	switch (planar->fourcc) {
+	case GBM_FORMAT_NV12:
+	case GBM_FORMAT_NV16:
+	case DRM_FORMAT_P010:
+		ycbcr->cb = base + gbm_hnd->offsets[1];
+		ycbcr->cr = base + gbm_hnd->offsets[1] + planar->cpp;
+		ycbcr->chroma_step = 2 * planar->cpp;
+		break;
+	case GBM_FORMAT_NV21:
+		ycbcr->cr = base + gbm_hnd->offsets[1];
+		ycbcr->cb = base + gbm_hnd->offsets[1] + planar->cpp;
+		ycbcr->chroma_step = 2 * planar->cpp;
+		break;
+	case GBM_FORMAT_YVU420:
+		ycbcr->cr = base + gbm_hnd->offsets[1];
+		ycbcr->cb = base + gbm_hnd->offsets[2];
+		ycbcr->chroma_step = 1;
+		break;
+	}
+}
 
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle,
 		int usage, int x, int y, int w, int h,
 		struct android_ycbcr *ycbcr)
 {
 	struct gralloc_handle_t *hnd = gralloc_handle(handle);
-	int ystride, cstride;
 	void *addr = 0;
 	int err;
 
 	ALOGV("handle %p, hnd %p, usage 0x%x", handle, hnd, usage);
 
+	if (!gralloc_gbm_has_ycbcr(handle)) {
+		ALOGE("Can not lock buffer, invalid format: 0x%x", hnd->format);
+		return -EINVAL;
+	}
+
 	err = gralloc_gbm_bo_lock(handle, usage, x, y, w, h, &addr);
 	if (err)
 		return err;
 
-	memset(ycbcr->reserved, 0, sizeof(ycbcr->reserved));
-
-	switch (hnd->format) {
-	case HAL_PIXEL_FORMAT_YCrCb_420_SP:
-	case HAL_PIXEL_FORMAT_YCbCr_420_888:
-		ystride = cstride = GRALLOC_ALIGN(hnd->width, 16);
-		ycbcr->y = addr;
-		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + 1;
-		ycbcr->ystride = ystride;
-		ycbcr->cstride = cstride;
-		ycbcr->chroma_step = 2;
-		break;
-	case HAL_PIXEL_FORMAT_YV12:
-		ystride = hnd->width;
-		cstride = GRALLOC_ALIGN(ystride / 2, 16);
-		ycbcr->y = addr;
-		ycbcr->cr = (unsigned char *)addr + ystride * hnd->height;
-		ycbcr->cb = (unsigned char *)addr + ystride * hnd->height + cstride * hnd->height / 2;
-		ycbcr->ystride = ystride;
-		ycbcr->cstride = cstride;
-		ycbcr->chroma_step = 1;
-		break;
-	default:
-		ALOGE("Can not lock buffer, invalid format: 0x%x", hnd->format);
-		return -EINVAL;
-	}
+	gralloc_gbm_get_ycbcr(handle, addr, ycbcr);
 
 	return 0;
 }
@@ -0,0 +1,70 @@
+/*
+ * Copyright (C) 2026 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+#ifndef _GRALLOC_GBM_HANDLE_H_
+#define _GRALLOC_GBM_HANDLE_H_
+
+#include <stdint.h>
+#include <cutils/native_handle.h>
+#include <android/gralloc_handle.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define GRALLOC_GBM_MAX_PLANES 4
+
+/*
+ * Handles allocated by gralloc.gbm extend gralloc_handle_t with the layout
+ * of every plane of the buffer. All planes live in the BO behind prime_fd.
+ */
+struct gralloc_gbm_handle_t {
+	struct gralloc_handle_t base;
+
+	uint32_t drm_format;	/* fourcc describing the planes */
+	uint32_t bo_format;	/* fourcc the gbm bo was created with */
+	uint32_t bo_width;
+	uint32_t bo_height;
+	uint32_t num_planes;
+	uint32_t offsets[GRALLOC_GBM_MAX_PLANES];
+	uint32_t strides[GRALLOC_GBM_MAX_PLANES];
+};
+
+#define GRALLOC_GBM_HANDLE_NUM_INTS ( \
+	((sizeof(struct gralloc_gbm_handle_t) - sizeof(native_handle_t))/sizeof(int)) \
+	 - GRALLOC_HANDLE_NUM_FDS)
+
+/*
+ * Return the extended handle, or NULL for a plain gralloc_handle_t.
+ */
+static inline struct gralloc_gbm_handle_t *gralloc_gbm_handle(buffer_handle_t handle)
+{
+	if (handle->numInts < (int)GRALLOC_GBM_HANDLE_NUM_INTS)
+		return NULL;
+
+	return (struct gralloc_gbm_handle_t *)handle;
+}
+
+#ifdef __cplusplus
+}
+#endif
+#endif /* _GRALLOC_GBM_HANDLE_H_ */
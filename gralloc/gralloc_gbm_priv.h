@@ -38,6 +38,19 @@ int gralloc_gbm_handle_unregister(buffer_handle_t handle);
 buffer_handle_t gralloc_gbm_bo_create(struct gbm_device *gbm,
 		int width, int height, int format, int usage, int *stride);
 void gbm_free(buffer_handle_t handle);
+void gralloc_gbm_bo_free(buffer_handle_t handle);
+void gralloc_gbm_dump(char *buff, int buff_len);
+
+struct gralloc_gbm_alloc_stats;
+struct gralloc_gbm_buffer_info;
+
+void gralloc_gbm_stats_alloc(buffer_handle_t handle);
+void gralloc_gbm_stats_free(buffer_handle_t handle);
+int64_t gralloc_gbm_stats_lock(void);
+void gralloc_gbm_stats_mapped(int64_t since);
+void gralloc_gbm_get_alloc_stats(struct gralloc_gbm_alloc_stats *stats);
+uint32_t gralloc_gbm_get_inventory(struct gralloc_gbm_buffer_info *buffers,
+		uint32_t count);
 
 struct gbm_bo *gralloc_gbm_bo_from_handle(buffer_handle_t handle);
 buffer_handle_t gralloc_gbm_bo_get_handle(struct gbm_bo *bo);
@@ -48,6 +61,26 @@ int gralloc_gbm_bo_unlock(buffer_handle_t handle);
 int gralloc_gbm_bo_lock_ycbcr(buffer_handle_t handle, int usage,
 		int x, int y, int w, int h, struct android_ycbcr *ycbcr);
 
+native_handle_t *gralloc_gbm_handle_create(int width, int height,
+		int format, int usage);
+int gralloc_gbm_get_bpp(int format);
+uint64_t gralloc_gbm_linear_layout(buffer_handle_t handle);
+void gbm_cpu_sync(int fd, int usage, bool end);
+bool gralloc_gbm_has_ycbcr(buffer_handle_t handle);
+void gralloc_gbm_get_ycbcr(buffer_handle_t handle, void *addr,
+		struct android_ycbcr *ycbcr);
+
+/* software backend, for hosts without a render node */
+buffer_handle_t gralloc_soft_bo_create(int width, int height, int format,
+		int usage, int *stride);
+void gralloc_soft_bo_free(buffer_handle_t handle);
+int gralloc_soft_handle_register(buffer_handle_t handle);
+int gralloc_soft_handle_unregister(buffer_handle_t handle);
+int gralloc_soft_bo_lock(buffer_handle_t handle, int usage, void **addr);
+int gralloc_soft_bo_unlock(buffer_handle_t handle);
+int gralloc_soft_bo_lock_ycbcr(buffer_handle_t handle, int usage,
+		struct android_ycbcr *ycbcr);
+
 struct gbm_device *gbm_dev_create(void);
 void gbm_dev_destroy(struct gbm_device *gbm);
 
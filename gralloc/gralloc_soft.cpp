@@ -0,0 +1,343 @@
+/*
+ * Copyright (C) 2026 The Waydroid Project
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+/*
+ * Software backend used when no render node can be opened. Buffers are
+ * linear shared memory, exported as a dma-buf through /dev/udmabuf when the
+ * kernel has it so that the compositor can still import them, or passed on
+ * as a plain memfd otherwise.
+ */
+
+#define LOG_TAG "GRALLOC-SOFT"
+
+#include <log/log.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/memfd.h>
+#include <linux/udmabuf.h>
+
+#include <hardware/gralloc.h>
+#include <system/graphics.h>
+
+#include <drm/drm_fourcc.h>
+
+#include "gralloc_gbm_priv.h"
+#include "gralloc_gbm_handle.h"
+#include <android/gralloc_handle.h>
+
+#include <unordered_map>
+
+#define GRALLOC_ALIGN(value, base) (((value) + ((base)-1)) & ~((base)-1))
+
+struct soft_buffer {
+	void *addr;
+	size_t size;
+	int lock_count;
+	int locked_for;
+	int64_t mapped_since;
+};
+
+static pthread_mutex_t soft_mutex = PTHREAD_MUTEX_INITIALIZER;
+static std::unordered_map<buffer_handle_t, struct soft_buffer> soft_buffers;
+
+/*
+ * Wrap a memfd in a dma-buf. Returns -1 when udmabuf is not available.
+ */
+static int soft_export_udmabuf(int memfd, size_t size)
+{
+	struct udmabuf_create create;
+	int dev, fd;
+
+	dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (dev < 0)
+		return -1;
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = size;
+
+	fd = ioctl(dev, UDMABUF_CREATE, &create);
+	if (fd < 0)
+		ALOGV("udmabuf export failed: %s", strerror(errno));
+	close(dev);
+
+	return fd;
+}
+
+/*
+ * Allocate the backing memory of a buffer. udmabuf wants page aligned,
+ * shrink-sealed memfds.
+ */
+static int soft_alloc_fd(size_t size)
+{
+	int memfd, fd;
+
+	memfd = syscall(__NR_memfd_create, "gralloc", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0) {
+		ALOGE("memfd_create failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (ftruncate(memfd, size)) {
+		ALOGE("failed to size memfd to %zu: %s", size, strerror(errno));
+		close(memfd);
+		return -1;
+	}
+
+	fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK);
+
+	fd = soft_export_udmabuf(memfd, size);
+	if (fd < 0)
+		return memfd;
+
+	close(memfd);
+	return fd;
+}
+
+/*
+ * Map the buffer on first CPU access and keep it mapped until it is freed.
+ */
+static void *soft_map(struct soft_buffer *buf, int fd)
+{
+	off_t size;
+	void *addr;
+
+	if (buf->addr)
+		return buf->addr;
+
+	size = lseek(fd, 0, SEEK_END);
+	if (size <= 0)
+		return NULL;
+
+	addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		ALOGE("failed to map buffer fd %d: %s", fd, strerror(errno));
+		return NULL;
+	}
+
+	buf->addr = addr;
+	buf->size = size;
+
+	return addr;
+}
+
+static void soft_forget(buffer_handle_t handle)
+{
+	pthread_mutex_lock(&soft_mutex);
+	auto it = soft_buffers.find(handle);
+	if (it != soft_buffers.end()) {
+		if (it->second.addr)
+			munmap(it->second.addr, it->second.size);
+		soft_buffers.erase(it);
+	}
+	pthread_mutex_unlock(&soft_mutex);
+}
+
+/*
+ * Create a buffer.
+ */
+buffer_handle_t gralloc_soft_bo_create(int width, int height, int format,
+		int usage, int *stride)
+{
+	native_handle_t *handle;
+	struct gralloc_handle_t *hnd;
+	uint64_t size;
+	int bpp = gralloc_gbm_get_bpp(format);
+
+	handle = gralloc_gbm_handle_create(width, height, format, usage);
+	if (!handle)
+		return NULL;
+
+	size = gralloc_gbm_linear_layout(handle);
+	if (!size || !bpp) {
+		ALOGE("unsupported format 0x%x", format);
+		native_handle_delete(handle);
+		gralloc_gbm_stats_alloc(NULL);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	hnd = gralloc_handle(handle);
+	hnd->prime_fd = soft_alloc_fd(GRALLOC_ALIGN(size, (uint64_t)getpagesize()));
+	if (hnd->prime_fd < 0) {
+		native_handle_delete(handle);
+		gralloc_gbm_stats_alloc(NULL);
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	pthread_mutex_lock(&soft_mutex);
+	soft_buffers[handle] = soft_buffer();
+	pthread_mutex_unlock(&soft_mutex);
+
+	gralloc_gbm_stats_alloc(handle);
+
+	/* in pixels */
+	*stride = hnd->stride / bpp;
+
+	return handle;
+}
+
+/*
+ * Free a buffer created locally. The caller closes and deletes the handle.
+ */
+void gralloc_soft_bo_free(buffer_handle_t handle)
+{
+	gralloc_gbm_stats_free(handle);
+	soft_forget(handle);
+}
+
+/*
+ * Register a buffer handle.
+ */
+int gralloc_soft_handle_register(buffer_handle_t handle)
+{
+	int err = 0;
+
+	if (!handle || gralloc_handle(handle)->prime_fd < 0)
+		return -EINVAL;
+
+	pthread_mutex_lock(&soft_mutex);
+	if (!soft_buffers.emplace(handle, soft_buffer()).second)
+		err = -EINVAL;
+	pthread_mutex_unlock(&soft_mutex);
+
+	return err;
+}
+
+/*
+ * Unregister a buffer handle.
+ */
+int gralloc_soft_handle_unregister(buffer_handle_t handle)
+{
+	soft_forget(handle);
+
+	return 0;
+}
+
+/*
+ * Lock a buffer. The whole buffer is mapped whatever the rectangle.
+ */
+int gralloc_soft_bo_lock(buffer_handle_t handle, int usage, void **addr)
+{
+	struct gralloc_handle_t *hnd = gralloc_handle(handle);
+	int err = 0;
+
+	pthread_mutex_lock(&soft_mutex);
+	auto it = soft_buffers.find(handle);
+	if (it == soft_buffers.end()) {
+		pthread_mutex_unlock(&soft_mutex);
+		return -EINVAL;
+	}
+
+	struct soft_buffer *buf = &it->second;
+
+	/* allow multiple locks with compatible usages */
+	if (buf->lock_count && (buf->locked_for & usage) != usage) {
+		pthread_mutex_unlock(&soft_mutex);
+		return -EINVAL;
+	}
+
+	usage |= buf->locked_for;
+
+	if (usage & (GRALLOC_USAGE_SW_WRITE_MASK |
+		     GRALLOC_USAGE_SW_READ_MASK)) {
+		*addr = soft_map(buf, hnd->prime_fd);
+		if (*addr)
+			gbm_cpu_sync(hnd->prime_fd, usage, false);
+		else
+			err = -ENOMEM;
+	}
+
+	if (!err) {
+		int64_t since = gralloc_gbm_stats_lock();
+		if (!buf->lock_count)
+			buf->mapped_since = since;
+		buf->lock_count++;
+		buf->locked_for |= usage;
+	}
+	pthread_mutex_unlock(&soft_mutex);
+
+	return err;
+}
+
+/*
+ * Unlock a buffer.
+ */
+int gralloc_soft_bo_unlock(buffer_handle_t handle)
+{
+	pthread_mutex_lock(&soft_mutex);
+	auto it = soft_buffers.find(handle);
+	if (it == soft_buffers.end()) {
+		pthread_mutex_unlock(&soft_mutex);
+		return -EINVAL;
+	}
+
+	struct soft_buffer *buf = &it->second;
+	int mapped = buf->locked_for &
+		(GRALLOC_USAGE_SW_WRITE_MASK | GRALLOC_USAGE_SW_READ_MASK);
+
+	if (buf->lock_count) {
+		if (mapped && buf->addr)
+			gbm_cpu_sync(gralloc_handle(handle)->prime_fd, mapped, true);
+
+		buf->lock_count--;
+		if (!buf->lock_count) {
+			if (mapped)
+				gralloc_gbm_stats_mapped(buf->mapped_since);
+			buf->locked_for = 0;
+		}
+	}
+	pthread_mutex_unlock(&soft_mutex);
+
+	return 0;
+}
+
+int gralloc_soft_bo_lock_ycbcr(buffer_handle_t handle, int usage,
+		struct android_ycbcr *ycbcr)
+{
+	void *addr = NULL;
+	int err;
+
+	if (!gralloc_gbm_has_ycbcr(handle)) {
+		ALOGE("Can not lock buffer, invalid format: 0x%x",
+			gralloc_handle(handle)->format);
+		return -EINVAL;
+	}
+
+	err = gralloc_soft_bo_lock(handle, usage, &addr);
+	if (err)
+		return err;
+
+	gralloc_gbm_get_ycbcr(handle, addr, ycbcr);
+
+	return 0;
+}
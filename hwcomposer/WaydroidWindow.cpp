@@ -39,17 +39,18 @@ static const struct zwp_relative_pointer_v1_listener relative_pointer_listener =
 Return<bool> WaydroidWindow::minimize(const hidl_string& packageName) {
     char property[PROPERTY_VALUE_MAX];
 
-    if (!mDisplay->wm_base)
+    std::scoped_lock connectionLock(mDisplay->connection_mutex);
+    if (mDisplay->connection_state != WAYLAND_CONNECTED || !mDisplay->wm_base)
         return false;
 
     property_get("waydroid.active_apps", property, "Waydroid");
     if (!strcmp(property, "Waydroid"))
         return false;
 
-    std::scoped_lock lock(mDisplay->windowsMutex);
-    for (auto it = mDisplay->windows.begin(); it != mDisplay->windows.end(); it++) {
-        struct window* window = it->second;
-        if (window && window->appID == packageName) {
+    auto windows = get_windows(mDisplay);
+    for (auto const& [surface, window] : *windows) {
+        std::scoped_lock lock(window->mutex);
+        if (window->isActive && window->appID == packageName) {
             xdg_toplevel_set_minimized(window->xdg_toplevel);
             return true;
         }
@@ -62,6 +63,10 @@ Return<void> WaydroidWindow::setPointerCapture(const hidl_string& packageName, b
     char property[PROPERTY_VALUE_MAX];
     std::string windowName = packageName;
 
+    std::scoped_lock connectionLock(mDisplay->connection_mutex);
+    if (mDisplay->connection_state != WAYLAND_CONNECTED)
+        return Void();
+
     if (!mDisplay->pointer_constraints)
         return Void();
 
@@ -72,10 +77,10 @@ Return<void> WaydroidWindow::setPointerCapture(const hidl_string& packageName, b
     if (!strcmp(property, "Waydroid"))
         windowName = "Waydroid";
 
-    std::scoped_lock lock(mDisplay->windowsMutex);
-    for (auto it = mDisplay->windows.begin(); it != mDisplay->windows.end(); it++) {
-        struct window* window = it->second;
-        if (window && window->appID == windowName) {
+    auto windows = get_windows(mDisplay);
+    for (auto const& [surface, window] : *windows) {
+        std::scoped_lock lock(window->mutex);
+        if (window->isActive && window->appID == windowName) {
             if (enabled && window->locked_pointer == nullptr) {
                 window->locked_pointer = zwp_pointer_constraints_v1_lock_pointer(
                         mDisplay->pointer_constraints,
@@ -90,9 +95,8 @@ Return<void> WaydroidWindow::setPointerCapture(const hidl_string& packageName, b
                 zwp_locked_pointer_v1_destroy(window->locked_pointer);
                 window->locked_pointer = nullptr;
                 bool anyLocks = false;
-                for (auto jt = mDisplay->windows.begin(); jt != mDisplay->windows.end(); jt++) {
-                    struct window* window = jt->second;
-                    if (window->locked_pointer) {
+                for (auto const& [other_surface, other] : *windows) {
+                    if (other->locked_pointer) {
                         anyLocks = true;
                         break;
                     }
@@ -113,17 +117,18 @@ Return<void> WaydroidWindow::setIdleInhibit(const hidl_string& task, bool enable
     char property[PROPERTY_VALUE_MAX];
     std::string taskID = task;
 
-    if (!mDisplay->idle_manager)
+    std::scoped_lock connectionLock(mDisplay->connection_mutex);
+    if (mDisplay->connection_state != WAYLAND_CONNECTED || !mDisplay->idle_manager)
         return Void();
 
     property_get("waydroid.active_apps", property, "Waydroid");
     if (!strcmp(property, "Waydroid"))
         taskID = "0";
 
-    std::scoped_lock lock(mDisplay->windowsMutex);
-    for (auto it = mDisplay->windows.begin(); it != mDisplay->windows.end(); it++) {
-        struct window* window = it->second;
-        if (window && window->isActive && (window->taskID == taskID || taskID == "*")) {
+    auto windows = get_windows(mDisplay);
+    for (auto const& [surface, window] : *windows) {
+        std::scoped_lock lock(window->mutex);
+        if (window->isActive && (window->taskID == taskID || taskID == "*")) {
             ALOGI("%sinhibiting sleep from %s#%s", enabled ? "" : "not ", window->appID.c_str(), window->taskID.c_str());
             if (enabled && window->idle_inhibitor == nullptr) {
                 window->idle_inhibitor = zwp_idle_inhibit_manager_v1_create_inhibitor(
@@ -33,6 +33,7 @@
 #include <GLES2/gl2ext.h>
 
 #include <semaphore.h>
+#include <string.h>
 #include <ui/GraphicBuffer.h>
 
 const char* eglStrError(EGLint err)
@@ -57,11 +58,15 @@ const char* eglStrError(EGLint err)
     }
 }
 
-void egl_init(struct display* display) {
+// Only a context is needed, egl_render_to_pixels renders into an FBO
+static void egl_init(struct display* display) {
     display->egl_dpy = eglGetDisplay(EGL_DEFAULT_DISPLAY);
     eglInitialize(display->egl_dpy, NULL, NULL);
     ALOGI("eglInitialize: %s", eglStrError(eglGetError()));
 
+    const char *extensions = eglQueryString(display->egl_dpy, EGL_EXTENSIONS);
+    bool surfaceless = extensions && strstr(extensions, "EGL_KHR_surfaceless_context");
+
     EGLConfig config;
     int num_config;
     EGLint dpy_attrs[] = {
@@ -79,12 +84,15 @@ void egl_init(struct display* display) {
     EGLContext ctx = eglCreateContext(display->egl_dpy, config,  EGL_NO_CONTEXT, context_attrs);
     ALOGI("eglCreateContext: %s", eglStrError(eglGetError()));
 
-    EGLint pbuf_attrs[] = { EGL_WIDTH, EGLint(display->width * display->scale), EGL_HEIGHT, EGLint(display->height * display->scale), EGL_NONE };
-    EGLSurface pbuf = eglCreatePbufferSurface(display->egl_dpy, config, pbuf_attrs);
-    ALOGI("eglCreatePbufferSurface: %s", eglStrError(eglGetError()));
+    EGLSurface pbuf = EGL_NO_SURFACE;
+    if (!surfaceless) {
+        EGLint pbuf_attrs[] = { EGL_WIDTH, 1, EGL_HEIGHT, 1, EGL_NONE };
+        pbuf = eglCreatePbufferSurface(display->egl_dpy, config, pbuf_attrs);
+        ALOGI("eglCreatePbufferSurface: %s", eglStrError(eglGetError()));
+    }
 
     eglMakeCurrent(display->egl_dpy, pbuf, pbuf, ctx);
-    ALOGI("eglMakeCurrent: %s", eglStrError(eglGetError()));
+    ALOGI("eglMakeCurrent%s: %s", surfaceless ? " (surfaceless)" : "", eglStrError(eglGetError()));
 
     GLuint offscreen_framebuffer;
     glGenFramebuffers(1, &offscreen_framebuffer);
@@ -121,10 +129,15 @@ void egl_render_to_pixels(struct display* display, struct buffer* buf) {
 
 void* egl_loop(void* data) {
     struct display* display = (struct display*) data;
-    egl_init(display);
+    bool initialized = false;
 
     while (true) {
         sem_wait(&display->egl_go);
+        // Most setups never read back SHM buffers or snapshot windows
+        if (!initialized) {
+            egl_init(display);
+            initialized = true;
+        }
         for (auto const& f : display->egl_work_queue) {
             f();
         }
@@ -14,12 +14,14 @@
  * limitations under the License.
  */
 
+#include <string.h>
+
 #include "extension.h"
 
 namespace vendor {
 namespace waydroid {
 namespace display {
-namespace V1_1 {
+namespace V1_2 {
 namespace implementation {
 
 WaydroidDisplay::WaydroidDisplay(struct display *display)
@@ -29,41 +31,144 @@ WaydroidDisplay::WaydroidDisplay(struct display *display)
 
 // Methods from ::vendor::waydroid::display::V1_0::IWaydroidDisplay follow.
 Return<Error> WaydroidDisplay::setLayerName(uint32_t layer, const hidl_string &name) {
-    mDisplay->layer_names[layer] = std::string(name);
+    std::string layer_name(name);
+    std::scoped_lock lock(mDisplay->layer_slots.mutex);
+    struct layerSlot *slot = get_layer_slot(&mDisplay->layer_slots, layer);
+    if (!slot)
+        return Error::BAD_LAYER;
+
+    // Parsed once here so that hwc_set doesn't need to
+    struct layerInfo *info = begin_layer_update(slot);
+    strlcpy(info->rawName, layer_name.substr(0, layer_name.find('#')).c_str(), sizeof(info->rawName));
+    if (mDisplay->layer_tasks_pushed) {
+        end_layer_update(slot);
+        return Error::NONE;
+    }
+
+    if (layer_name.substr(0, 4) == "TID:" && layer_name.find('#') != std::string::npos) {
+        std::string layer_tid = layer_name.substr(4, layer_name.find('#') - 4);
+        std::string layer_aid = layer_name.substr(layer_name.find('#') + 1, layer_name.find('/') - layer_name.find('#') - 1);
+        strlcpy(info->tid, layer_tid.c_str(), sizeof(info->tid));
+        strlcpy(info->aid, layer_aid.c_str(), sizeof(info->aid));
+        end_layer_update(slot);
+
+        // Warm the task service's name cache before the window for this task gets created
+        if (mDisplay->task_state == TASK_SERVICE_READY && mDisplay->task_1_1 &&
+            mSeenTasks.insert(layer_tid).second) {
+            if (mSeenTasks.size() > SEEN_TASKS_MAX)
+                mSeenTasks.clear();
+            mDisplay->task_1_1->prefetchAppName(layer_aid);
+        }
+    } else {
+        info->tid[0] = '\0';
+        info->aid[0] = '\0';
+        end_layer_update(slot);
+    }
     return Error::NONE;
 }
 Return<Error> WaydroidDisplay::setLayerHandleInfo(uint32_t layer, uint32_t format, uint32_t stride) {
-    mDisplay->layer_handles_ext[layer] = 
+    std::scoped_lock lock(mDisplay->layer_slots.mutex);
+    struct layerSlot *slot = get_layer_slot(&mDisplay->layer_slots, layer);
+    if (!slot)
+        return Error::BAD_LAYER;
+
+    struct layerInfo *info = begin_layer_update(slot);
+    info->ext = 
     {
         .format = format,
         .stride = stride
     };
+    end_layer_update(slot);
     return Error::NONE;
 }
 Return<Error> WaydroidDisplay::setTargetLayerHandleInfo(uint32_t format, uint32_t stride) {
-    mDisplay->target_layer_handle_ext = 
+    std::scoped_lock lock(mDisplay->layer_slots.mutex);
+    struct layerInfo *info = begin_layer_update(&mDisplay->layer_slots.target);
+    info->ext = 
     {
         .format = format,
         .stride = stride
     };
+    end_layer_update(&mDisplay->layer_slots.target);
     return Error::NONE;
 }
 
 // Methods from ::vendor::waydroid::display::V1_1::IWaydroidDisplay follow.
 Return<Error> WaydroidDisplay::setLayerSize(uint32_t layer, uint32_t width, uint32_t height) {
-    mDisplay->layer_handles_ext[layer].width = width;
-    mDisplay->layer_handles_ext[layer].height = height;
+    std::scoped_lock lock(mDisplay->layer_slots.mutex);
+    struct layerSlot *slot = get_layer_slot(&mDisplay->layer_slots, layer);
+    if (!slot)
+        return Error::BAD_LAYER;
+
+    struct layerInfo *info = begin_layer_update(slot);
+    info->ext.width = width;
+    info->ext.height = height;
+    end_layer_update(slot);
     return Error::NONE;
 }
 
 Return<Error> WaydroidDisplay::setTargetLayerSize(uint32_t width, uint32_t height) {
-    mDisplay->target_layer_handle_ext.width = width;
-    mDisplay->target_layer_handle_ext.height = height;
+    std::scoped_lock lock(mDisplay->layer_slots.mutex);
+    struct layerInfo *info = begin_layer_update(&mDisplay->layer_slots.target);
+    info->ext.width = width;
+    info->ext.height = height;
+    end_layer_update(&mDisplay->layer_slots.target);
+    return Error::NONE;
+}
+
+// Methods from ::vendor::waydroid::display::V1_2::IWaydroidDisplay follow.
+Return<Error> WaydroidDisplay::registerApp(uint32_t appID, const hidl_string &packageName) {
+    if (appID == 0)
+        return Error::BAD_PARAMETER;
+
+    {
+        std::scoped_lock lock(mDisplay->registry_mutex);
+        mDisplay->app_registry[appID] = std::string(packageName);
+    }
+    if (mDisplay->task_state == TASK_SERVICE_READY && mDisplay->task_1_1)
+        mDisplay->task_1_1->prefetchAppName(packageName);
     return Error::NONE;
 }
 
+Return<Error> WaydroidDisplay::setLayerTasks(const hidl_vec<LayerTask> &layers) {
+    // From now on layer names are only used for non-task layers
+    mDisplay->layer_tasks_pushed = true;
+
+    std::scoped_lock lock(mDisplay->layer_slots.mutex, mDisplay->registry_mutex);
+    clear_layer_tasks(&mDisplay->layer_slots);
+    for (const LayerTask &task : layers) {
+        struct layerSlot *slot = get_layer_slot(&mDisplay->layer_slots, task.layer);
+        if (!slot || task.taskID < 0)
+            continue;
+
+        struct layerInfo *info = begin_layer_update(slot);
+        snprintf(info->tid, sizeof(info->tid), "%d", task.taskID);
+        auto it = mDisplay->app_registry.find(task.appID);
+        if (it != mDisplay->app_registry.end())
+            strlcpy(info->aid, it->second.c_str(), sizeof(info->aid));
+        end_layer_update(slot);
+    }
+    return Error::NONE;
+}
+
+Return<Error> WaydroidDisplay::registerLayerName(uint32_t nameID, const hidl_string &name) {
+    std::string layer_name(name);
+    std::scoped_lock lock(mDisplay->registry_mutex);
+    mDisplay->layer_name_registry[nameID] = layer_name.substr(0, layer_name.find('#'));
+    return Error::NONE;
+}
+
+Return<void> WaydroidDisplay::getLayerMetadataQueue(getLayerMetadataQueue_cb _hidl_cb) {
+    if (!mDisplay->layer_metadata_queue) {
+        _hidl_cb(Error::NO_RESOURCES, LayerMetadataQueue::Descriptor());
+        return Void();
+    }
+    _hidl_cb(Error::NONE, *mDisplay->layer_metadata_queue->getDesc());
+    return Void();
+}
+
 }  // namespace implementation
-}  // namespace V1_1
+}  // namespace V1_2
 }  // namespace display
 }  // namespace waydroid
 }  // namespace vendor
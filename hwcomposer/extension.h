@@ -13,28 +13,33 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
-#ifndef VENDOR_WAYDROID_DISPLAY_V1_1_WAYDROIDDISPLAY_H
-#define VENDOR_WAYDROID_DISPLAY_V1_1_WAYDROIDDISPLAY_H
+#ifndef VENDOR_WAYDROID_DISPLAY_V1_2_WAYDROIDDISPLAY_H
+#define VENDOR_WAYDROID_DISPLAY_V1_2_WAYDROIDDISPLAY_H
 
 #include <android/hardware/graphics/composer/2.1/IComposer.h>
-#include <vendor/waydroid/display/1.1/IWaydroidDisplay.h>
+#include <vendor/waydroid/display/1.2/IWaydroidDisplay.h>
 #include <hidl/HidlTransportSupport.h>
 #include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
 
 #include "wayland-hwc.h"
 
+#define SEEN_TASKS_MAX 256
+
 namespace vendor {
 namespace waydroid {
 namespace display {
-namespace V1_1 {
+namespace V1_2 {
 namespace implementation {
 
 using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
 using ::android::hardware::Return;
+using ::android::hardware::Void;
 using ::android::hardware::graphics::composer::V2_1::Error;
 using ::android::sp;
-using ::vendor::waydroid::display::V1_1::IWaydroidDisplay;
+using ::vendor::waydroid::display::V1_2::IWaydroidDisplay;
+using ::vendor::waydroid::display::V1_2::LayerTask;
 
 class WaydroidDisplay : public IWaydroidDisplay {
   public:
@@ -48,14 +53,21 @@ class WaydroidDisplay : public IWaydroidDisplay {
     // Methods from ::vendor::waydroid::display::V1_1::IWaydroidDisplay follow.
     Return<Error> setLayerSize(uint32_t layer, uint32_t width, uint32_t height) override;
     Return<Error> setTargetLayerSize(uint32_t width, uint32_t height) override;
+
+    // Methods from ::vendor::waydroid::display::V1_2::IWaydroidDisplay follow.
+    Return<Error> registerApp(uint32_t appID, const hidl_string &packageName) override;
+    Return<Error> setLayerTasks(const hidl_vec<LayerTask> &layers) override;
+    Return<Error> registerLayerName(uint32_t nameID, const hidl_string &name) override;
+    Return<void> getLayerMetadataQueue(getLayerMetadataQueue_cb _hidl_cb) override;
   private:
     struct display *mDisplay;
+    std::set<std::string> mSeenTasks;
 };
 
 }  // namespace implementation
-}  // namespace V1_1
+}  // namespace V1_2
 }  // namespace display
 }  // namespace waydroid
 }  // namespace vendor
 
-#endif  // VENDOR_WAYDROID_DISPLAY_V1_1_WAYDROIDDISPLAY_H
+#endif  // VENDOR_WAYDROID_DISPLAY_V1_2_WAYDROIDDISPLAY_H
@@ -15,9 +15,11 @@
  * limitations under the License.
  */
 #include <errno.h>
+#include <inttypes.h>
 #include <pthread.h>
 #include <semaphore.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
 #include <sys/resource.h>
 #include <unistd.h>
@@ -25,8 +27,12 @@
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <string>
+#include <string_view>
+#include <vector>
 #include <sstream>
 #include <functional>
+#include <chrono>
+#include <algorithm>
 
 #include <log/log.h>
 #include <cutils/properties.h>
@@ -40,6 +46,7 @@
 #include <viewporter-client-protocol.h>
 #include <gralloc_handle.h>
 #include <cros_gralloc/cros_gralloc_handle.h>
+#include <gralloc_gbm_handle.h>
 
 #define ATRACE_TAG ATRACE_TAG_GRAPHICS
 #include <cutils/trace.h>
@@ -52,14 +59,24 @@
 using ::android::hardware::configureRpcThreadpool;
 using ::android::hardware::joinRpcThreadpool;
 
-using ::vendor::waydroid::display::V1_1::IWaydroidDisplay;
-using ::vendor::waydroid::display::V1_1::implementation::WaydroidDisplay;
+using ::vendor::waydroid::display::V1_2::IWaydroidDisplay;
+using ::vendor::waydroid::display::V1_2::implementation::WaydroidDisplay;
+using ::vendor::waydroid::display::V1_2::LayerMetadataFlags;
 using ::vendor::waydroid::window::V1_1::IWaydroidWindow;
 using ::vendor::waydroid::window::implementation::WaydroidWindow;
 
 using ::android::OK;
 using ::android::status_t;
 
+struct lostWindow {
+    std::string name;
+    std::string appID;
+    std::string taskID;
+    hwc_color_t color;
+};
+
+#define RECONNECT_INTERVAL_NS 500000000LL
+
 struct waydroid_hwc_composer_device_1 {
     hwc_composer_device_1_t base; // constant after init
     const hwc_procs_t *procs;     // constant after init
@@ -68,11 +85,22 @@ struct waydroid_hwc_composer_device_1 {
     pthread_t extension_thread;   // constant after init
     pthread_t window_service_thread; // constant after init
     pthread_t egl_worker_thread;  // constant after init
+    pthread_t window_worker_thread; // constant after init
+    pthread_t task_dispatch_thread; // constant after init
     int32_t vsync_period_ns;      // constant after init
     struct display *display;      // constant after init
-    std::map<std::string, struct window *> windows;
+    // Transparent comparator, so looking windows up doesn't build a std::string
+    std::map<std::string, std::shared_ptr<struct window>, std::less<>> windows;
     struct window *calib_window;
 
+    // Parsed "waydroid.blacklist_apps", only updated when the property changes
+    char blacklist_prop[PROPERTY_VALUE_MAX];
+    std::vector<std::string> blacklist_apps;
+#ifdef HWC_COUNT_ALLOCATIONS
+    uint64_t steady_state_allocations;
+    bool steady_state_allocations_fatal;
+#endif
+
     pthread_mutex_t vsync_lock;
     bool vsync_callback_enabled; // protected by this->vsync_lock
     uint64_t last_vsync_ns;
@@ -81,8 +109,125 @@ struct waydroid_hwc_composer_device_1 {
     int next_sync_point;
     bool use_subsurface;
     bool multi_windows;
+    int64_t frame_time_ns;        // CLOCK_MONOTONIC at the start of hwc_set
+
+    // Wayland requests sent and skipped by hwc_set, published for hwc_dump
+    uint32_t frame_requests;
+    uint32_t frame_requests_skipped;
+    std::atomic<uint32_t> last_frame_requests;
+    std::atomic<uint32_t> last_frame_requests_skipped;
+    std::atomic<uint64_t> total_requests;
+    std::atomic<uint64_t> total_requests_skipped;
+    std::atomic<uint64_t> counted_frames;
+
+    // The last flush hit the deadline with requests still buffered
+    bool congested;
+    int flush_timeout_ms;                  // constant after init
+    std::atomic<uint64_t> congested_frames;
+    std::atomic<uint64_t> dropped_frames;
+
+    // Startup timing, see boot_phase_end
+    int64_t open_ns;
+    bool first_frame_logged;
+
+    // Windows to rebuild once the compositor is back, see reconnect_wayland
+    std::vector<struct lostWindow> lost_windows;
+    bool connection_lost;
+    int64_t last_reconnect_ns;
+    std::atomic<uint64_t> reconnects;
 };
 
+#ifdef HWC_COUNT_ALLOCATIONS
+/*
+ * Counts operator new calls made from this library on the current thread.
+ * The replacements are hidden so the rest of SurfaceFlinger keeps using the
+ * default ones. Allocations made inside libc++ itself are not seen.
+ */
+static thread_local uint64_t tls_allocations;
+
+__attribute__((visibility("hidden"))) void *operator new(size_t size) {
+    tls_allocations++;
+    void *ptr = malloc(size ? size : 1);
+    LOG_ALWAYS_FATAL_IF(!ptr, "out of memory");
+    return ptr;
+}
+__attribute__((visibility("hidden"))) void *operator new[](size_t size) {
+    return operator new(size);
+}
+__attribute__((visibility("hidden"))) void operator delete(void *ptr) noexcept {
+    free(ptr);
+}
+__attribute__((visibility("hidden"))) void operator delete[](void *ptr) noexcept {
+    free(ptr);
+}
+__attribute__((visibility("hidden"))) void operator delete(void *ptr, size_t) noexcept {
+    free(ptr);
+}
+__attribute__((visibility("hidden"))) void operator delete[](void *ptr, size_t) noexcept {
+    free(ptr);
+}
+#endif
+
+static struct window *
+find_window(struct waydroid_hwc_composer_device_1 *pdev, std::string_view name)
+{
+    auto it = pdev->windows.find(name);
+    if (it == pdev->windows.end())
+        return NULL;
+    return it->second.get();
+}
+
+static bool
+is_blacklisted(struct waydroid_hwc_composer_device_1 *pdev, const char *appID)
+{
+    for (const std::string &app : pdev->blacklist_apps) {
+        if (app == appID)
+            return true;
+    }
+    return false;
+}
+
+static void
+update_blacklist(struct waydroid_hwc_composer_device_1 *pdev)
+{
+    char property[PROPERTY_VALUE_MAX];
+    property_get("waydroid.blacklist_apps", property, "com.android.launcher3");
+    if (!strcmp(property, pdev->blacklist_prop))
+        return;
+
+    strlcpy(pdev->blacklist_prop, property, sizeof(pdev->blacklist_prop));
+    pdev->blacklist_apps.clear();
+    std::istringstream iss(property);
+    std::string app;
+    while (std::getline(iss, app, ':'))
+        pdev->blacklist_apps.push_back(app);
+}
+
+// Whether the compositor advertised the format of the layer's buffer, the
+// other layers have to be composited by SurfaceFlinger
+static bool layer_importable(struct waydroid_hwc_composer_device_1 *pdev, const hwc_layer_1_t *layer)
+{
+    struct display *display = pdev->display;
+    int format;
+
+    if (!layer->handle || !display->dmabuf)
+        return true;
+    if (display->buffer_map.find(layer->handle) != display->buffer_map.end())
+        return true;
+
+    if (display->gtype == GRALLOC_GBM) {
+        const struct gralloc_gbm_handle_t *gbm_handle = gralloc_gbm_handle(layer->handle);
+        if (gbm_handle)
+            return isFormatSupported(display, gbm_handle->drm_format);
+        format = ConvertHalFormatToDrm(display, ((const struct gralloc_handle_t *)layer->handle)->format);
+    } else if (display->gtype == GRALLOC_CROS) {
+        format = ((const struct cros_gralloc_handle *)layer->handle)->format;
+    } else {
+        return true;
+    }
+    return format >= 0 && isFormatSupported(display, format);
+}
+
 static int hwc_prepare(hwc_composer_device_1_t* dev,
                        size_t numDisplays, hwc_display_contents_1_t** displays) {
     struct waydroid_hwc_composer_device_1 *pdev = (struct waydroid_hwc_composer_device_1 *)dev;
@@ -96,9 +241,14 @@ static int hwc_prepare(hwc_composer_device_1_t* dev,
     if ((contents->flags & HWC_GEOMETRY_CHANGED) && pdev->use_subsurface)
         pdev->display->geo_changed = true;
 
+    // Layers the compositor can't take are composited like skipped ones
     std::pair<int, int> skipped(-1, -1);
     for (size_t i = 0; i < contents->numHwLayers; i++) {
-      if (!(contents->hwLayers[i].flags & HWC_SKIP_LAYER))
+      hwc_layer_1_t *layer = &contents->hwLayers[i];
+      if (layer->compositionType == HWC_FRAMEBUFFER_TARGET)
+        continue;
+      if (!(layer->flags & HWC_SKIP_LAYER) &&
+          (!pdev->use_subsurface || layer_importable(pdev, layer)))
         continue;
 
       if (skipped.first == -1)
@@ -112,6 +262,13 @@ static int hwc_prepare(hwc_composer_device_1_t* dev,
         if (contents->hwLayers[i].flags & HWC_SKIP_LAYER)
             continue;
 
+        // Like skipped layers, these only show up through the framebuffer
+        // target, so not in multi windows mode
+        if (pdev->use_subsurface && !layer_importable(pdev, &contents->hwLayers[i])) {
+            contents->hwLayers[i].compositionType = HWC_FRAMEBUFFER;
+            continue;
+        }
+
         /* skipped layers have to be composited by SurfaceFlinger; so in order
            have correct z-ordering, we must ask SurfaceFlinger to composite
            everything between the first and the last skipped layer. Unfortunately,
@@ -163,23 +320,76 @@ static void update_shm_buffer(struct display* display, struct buffer *buffer)
     }
 }
 
-static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev, hwc_layer_1_t *layer, size_t pos)
+// Metadata of a layer as of the start of this frame, see snapshot_layers
+static const struct layerInfo &
+frame_layer(struct display *display, size_t layer)
 {
-    uint32_t format;
-    uint32_t pixel_stride;
-    uint32_t width;
-    uint32_t height;
-    if (layer->compositionType == HWC_FRAMEBUFFER_TARGET) {
-        format = pdev->display->target_layer_handle_ext.format;
-        pixel_stride = pdev->display->target_layer_handle_ext.stride;
-        width = pdev->display->target_layer_handle_ext.width;
-        height = pdev->display->target_layer_handle_ext.height;
-    } else {
-        format = pdev->display->layer_handles_ext[pos].format;
-        pixel_stride = pdev->display->layer_handles_ext[pos].stride;
-        width = pdev->display->layer_handles_ext[pos].width;
-        height = pdev->display->layer_handles_ext[pos].height;
+    static const struct layerInfo empty = {};
+    if (layer >= MAX_LAYERS)
+        return empty;
+    return display->layer_slots.frame[layer];
+}
+
+// Applies the newest frame SurfaceFlinger wrote to the layer metadata queue.
+// Each frame is written with a single write() so it is always complete.
+static void
+read_layer_metadata(struct display *display)
+{
+    LayerMetadataQueue *queue = display->layer_metadata_queue.get();
+    if (!queue)
+        return;
+
+    size_t available = queue->availableToRead();
+    if (!available || !queue->read(display->layer_metadata.data(), available))
+        return;
+
+    const LayerMetadata &last = display->layer_metadata[available - 1];
+    if (!last.layerCount || last.layerCount > available ||
+        display->layer_metadata[available - last.layerCount].sequence != last.sequence) {
+        ALOGE("Malformed layer metadata frame %u", last.sequence);
+        return;
+    }
+    size_t first = available - last.layerCount;
+
+    display->layer_tasks_pushed = true;
+    std::scoped_lock lock(display->layer_slots.mutex, display->registry_mutex);
+    clear_layer_tasks(&display->layer_slots);
+    for (size_t i = first; i < available; i++) {
+        const LayerMetadata &entry = display->layer_metadata[i];
+        struct layerSlot *slot = (entry.flags & LayerMetadataFlags::TARGET) ?
+                &display->layer_slots.target : get_layer_slot(&display->layer_slots, entry.layer);
+        if (!slot)
+            continue;
+
+        struct layerInfo *info = begin_layer_update(slot);
+        info->ext = {
+            .format = entry.format,
+            .stride = entry.stride,
+            .width = entry.width,
+            .height = entry.height
+        };
+        auto name = display->layer_name_registry.find(entry.nameID);
+        if (name != display->layer_name_registry.end())
+            strlcpy(info->rawName, name->second.c_str(), sizeof(info->rawName));
+        if (entry.taskID >= 0) {
+            snprintf(info->tid, sizeof(info->tid), "%d", entry.taskID);
+            auto app = display->app_registry.find(entry.appID);
+            if (app != display->app_registry.end())
+                strlcpy(info->aid, app->second.c_str(), sizeof(info->aid));
+        }
+        end_layer_update(slot);
     }
+    display->layer_metadata_seq = last.sequence;
+}
+
+static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev, hwc_layer_1_t *layer, size_t pos)
+{
+    const struct handleExt &ext = (layer->compositionType == HWC_FRAMEBUFFER_TARGET) ?
+            pdev->display->layer_slots.frame_target.ext : frame_layer(pdev->display, pos).ext;
+    uint32_t format = ext.format;
+    uint32_t pixel_stride = ext.stride;
+    uint32_t width = ext.width;
+    uint32_t height = ext.height;
 
     if (!width)
         width = layer->displayFrame.right - layer->displayFrame.left;
@@ -206,8 +416,17 @@ static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev,
     buf = new struct buffer();
     if (pdev->display->gtype == GRALLOC_GBM) {
         struct gralloc_handle_t *drm_handle = (struct gralloc_handle_t *)layer->handle;
-        if (pdev->display->dmabuf) {
-            ret = create_dmabuf_wl_buffer(pdev->display, buf, drm_handle->width, drm_handle->height, drm_handle->format, -1 /* compute drm format */, drm_handle->prime_fd, pixel_stride, drm_handle->stride, 0 /* offset */, drm_handle->modifier, layer->handle);
+        const struct gralloc_gbm_handle_t *gbm_handle = gralloc_gbm_handle(layer->handle);
+        if (pdev->display->dmabuf && gbm_handle) {
+            // All planes live in the same BO
+            uint32_t num_planes = std::min(gbm_handle->num_planes, (uint32_t)GRALLOC_GBM_MAX_PLANES);
+            int fds[GRALLOC_GBM_MAX_PLANES];
+            for (uint32_t i = 0; i < num_planes; i++)
+                fds[i] = drm_handle->prime_fd;
+            ret = create_dmabuf_wl_buffer(pdev->display, buf, drm_handle->width, drm_handle->height, drm_handle->format, gbm_handle->drm_format, num_planes, fds, gbm_handle->offsets, gbm_handle->strides, pixel_stride, drm_handle->modifier, layer->handle);
+        } else if (pdev->display->dmabuf) {
+            uint32_t offset = 0, stride = drm_handle->stride;
+            ret = create_dmabuf_wl_buffer(pdev->display, buf, drm_handle->width, drm_handle->height, drm_handle->format, -1 /* compute drm format */, 1, &drm_handle->prime_fd, &offset, &stride, pixel_stride, drm_handle->modifier, layer->handle);
         } else {
             ret = create_shm_wl_buffer(pdev->display, buf, drm_handle->width, drm_handle->height, drm_handle->format, pixel_stride, layer->handle);
             update_shm_buffer(pdev->display, buf);
@@ -215,7 +434,7 @@ static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev,
     } else if (pdev->display->gtype == GRALLOC_CROS) {
         const struct cros_gralloc_handle *cros_handle = (const struct cros_gralloc_handle *)layer->handle;
         if (pdev->display->dmabuf) {
-            ret = create_dmabuf_wl_buffer(pdev->display, buf, cros_handle->width, cros_handle->height, cros_handle->droid_format, cros_handle->format, cros_handle->fds[0], pixel_stride, cros_handle->strides[0], cros_handle->offsets[0], cros_handle->format_modifier, layer->handle);
+            ret = create_dmabuf_wl_buffer(pdev->display, buf, cros_handle->width, cros_handle->height, cros_handle->droid_format, cros_handle->format, 1, &cros_handle->fds[0], &cros_handle->offsets[0], &cros_handle->strides[0], pixel_stride, cros_handle->format_modifier, layer->handle);
         } else {
             ret = create_shm_wl_buffer(pdev->display, buf, cros_handle->width, cros_handle->height, cros_handle->droid_format, pixel_stride, layer->handle);
             update_shm_buffer(pdev->display, buf);
@@ -231,6 +450,7 @@ static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev,
 
     if (ret) {
         ALOGE("failed to create a wayland buffer");
+        delete buf;
         return NULL;
     }
     pdev->display->buffer_map[layer->handle] = buf;
@@ -238,6 +458,28 @@ static struct buffer *get_wl_buffer(struct waydroid_hwc_composer_device_1 *pdev,
     return pdev->display->buffer_map[layer->handle];
 }
 
+static int32_t wl_transform(uint32_t transform)
+{
+    switch (transform) {
+        case HWC_TRANSFORM_FLIP_H:
+            return WL_OUTPUT_TRANSFORM_FLIPPED_180;
+        case HWC_TRANSFORM_FLIP_V:
+            return WL_OUTPUT_TRANSFORM_FLIPPED;
+        case HWC_TRANSFORM_ROT_90:
+            return WL_OUTPUT_TRANSFORM_90;
+        case HWC_TRANSFORM_ROT_180:
+            return WL_OUTPUT_TRANSFORM_180;
+        case HWC_TRANSFORM_ROT_270:
+            return WL_OUTPUT_TRANSFORM_270;
+        case HWC_TRANSFORM_FLIP_H_ROT_90:
+            return WL_OUTPUT_TRANSFORM_FLIPPED_270;
+        case HWC_TRANSFORM_FLIP_V_ROT_90:
+            return WL_OUTPUT_TRANSFORM_FLIPPED_90;
+        default:
+            return WL_OUTPUT_TRANSFORM_NORMAL;
+    }
+}
+
 static void setup_viewport_destination(wp_viewport *viewport, hwc_rect_t frame, struct display *display)
 {
     wp_viewport_set_destination(viewport,
@@ -245,9 +487,14 @@ static void setup_viewport_destination(wp_viewport *viewport, hwc_rect_t frame,
             fmax(1, ceil((frame.bottom - frame.top) / display->scale)));
 }
 
-static struct wl_surface *get_surface(struct waydroid_hwc_composer_device_1 *pdev, hwc_layer_1_t *layer, struct window *window, bool multi)
+/*
+ * Returns the surface a layer is drawn on. *dirty is set when double-buffered
+ * surface state was changed, which only applies on the next commit.
+ */
+static struct wl_surface *get_surface(struct waydroid_hwc_composer_device_1 *pdev, hwc_layer_1_t *layer, struct window *window, bool multi,
+                                      struct surfaceState **statep, bool *dirty)
 {
-    pdev->display->windows[window->surface] = window;
+    *dirty = false;
     if (!multi) {
         pdev->display->layers[window->surface] = {
             .x = layer->displayFrame.left,
@@ -255,26 +502,22 @@ static struct wl_surface *get_surface(struct waydroid_hwc_composer_device_1 *pde
         if (!multi && pdev->display->scale != 1 && pdev->display->viewporter && !window->viewport) {
             window->viewport = wp_viewporter_get_viewport(pdev->display->viewporter, window->surface);
             setup_viewport_destination(window->viewport, layer->displayFrame, pdev->display);
+            pdev->frame_requests += 2;
+            *dirty = true;
         }
+        *statep = &window->mainState;
         return window->surface;
     }
 
-    struct wl_surface *surface = NULL;
-    struct wl_subsurface *subsurface = NULL;
-    struct wp_viewport *viewport = NULL;
+    if (window->lastLayer >= MAX_LAYERS)
+        return NULL;
 
-    if (window->surfaces.find(window->lastLayer) == window->surfaces.end()) {
-        surface = wl_compositor_create_surface(pdev->display->compositor);
-        subsurface = wl_subcompositor_get_subsurface(pdev->display->subcompositor,
-                                                     surface,
-                                                     window->surface);
-        if (pdev->display->viewporter)
-            viewport = wp_viewporter_get_viewport(pdev->display->viewporter, surface);
-        window->surfaces[window->lastLayer] = surface;
-        window->subsurfaces[window->lastLayer] = subsurface;
-        window->viewports[window->lastLayer] = viewport;
-    }
+    size_t l = window->lastLayer;
+    if (l >= window->surfaceCount)
+        add_layer_surface(window, pdev->frame_time_ns);
+    window->surfaceUsedAt[l] = pdev->frame_time_ns;
 
+    struct surfaceState *state = &window->surfaceStates[l];
     hwc_rect_t sourceCrop = layer->sourceCropi;
 
     if (layer->transform & HWC_TRANSFORM_ROT_90) {
@@ -285,27 +528,72 @@ static struct wl_surface *get_surface(struct waydroid_hwc_composer_device_1 *pde
     }
 
     if (pdev->display->viewporter) {
-        wp_viewport_set_source(window->viewports[window->lastLayer],
-                               wl_fixed_from_double(fmax(0, pdev->display->viewporter ? sourceCrop.left : sourceCrop.left / pdev->display->scale)),
-                               wl_fixed_from_double(fmax(0, pdev->display->viewporter ? sourceCrop.top : sourceCrop.top / pdev->display->scale)),
-                               wl_fixed_from_double(fmax(1, pdev->display->viewporter ? (sourceCrop.right - sourceCrop.left) :
-                                                                                        (sourceCrop.right - sourceCrop.left) / pdev->display->scale)),
-                               wl_fixed_from_double(fmax(1, pdev->display->viewporter ? (sourceCrop.bottom - sourceCrop.top) :
-                                                                                        (sourceCrop.bottom - sourceCrop.top) / pdev->display->scale)));
-
-        setup_viewport_destination(window->viewports[window->lastLayer], layer->displayFrame, pdev->display);
+        wl_fixed_t srcX = wl_fixed_from_double(fmax(0, sourceCrop.left));
+        wl_fixed_t srcY = wl_fixed_from_double(fmax(0, sourceCrop.top));
+        wl_fixed_t srcWidth = wl_fixed_from_double(fmax(1, sourceCrop.right - sourceCrop.left));
+        wl_fixed_t srcHeight = wl_fixed_from_double(fmax(1, sourceCrop.bottom - sourceCrop.top));
+        int32_t dstWidth = fmax(1, ceil((layer->displayFrame.right - layer->displayFrame.left) / pdev->display->scale));
+        int32_t dstHeight = fmax(1, ceil((layer->displayFrame.bottom - layer->displayFrame.top) / pdev->display->scale));
+
+        // Viewport state sticks to the surface, only send what changed
+        if (!state->valid || state->srcX != srcX || state->srcY != srcY ||
+            state->srcWidth != srcWidth || state->srcHeight != srcHeight) {
+            wp_viewport_set_source(window->viewports[l], srcX, srcY, srcWidth, srcHeight);
+            state->srcX = srcX;
+            state->srcY = srcY;
+            state->srcWidth = srcWidth;
+            state->srcHeight = srcHeight;
+            pdev->frame_requests++;
+            *dirty = true;
+        } else {
+            pdev->frame_requests_skipped++;
+        }
+        if (!state->valid || state->dstWidth != dstWidth || state->dstHeight != dstHeight) {
+            wp_viewport_set_destination(window->viewports[l], dstWidth, dstHeight);
+            state->dstWidth = dstWidth;
+            state->dstHeight = dstHeight;
+            pdev->frame_requests++;
+            *dirty = true;
+        } else {
+            pdev->frame_requests_skipped++;
+        }
     }
 
-    wl_subsurface_set_position(window->subsurfaces[window->lastLayer],
-                               floor(layer->displayFrame.left / pdev->display->scale),
-                               floor(layer->displayFrame.top / pdev->display->scale));
+    int32_t x = floor(layer->displayFrame.left / pdev->display->scale);
+    int32_t y = floor(layer->displayFrame.top / pdev->display->scale);
+    if (!state->valid || state->x != x || state->y != y) {
+        // Subsurface position is parent state
+        wl_subsurface_set_position(window->subsurfaces[l], x, y);
+        state->x = x;
+        state->y = y;
+        window->parentDirty = true;
+        pdev->frame_requests++;
+    } else {
+        pdev->frame_requests_skipped++;
+    }
+    state->valid = true;
 
     pdev->display->layers[window->surfaces[window->lastLayer]] = {
         .x = layer->displayFrame.left,
         .y = layer->displayFrame.top };
+    *statep = state;
     return window->surfaces[window->lastLayer];
 }
 
+/*
+ * Whether the layer's contents may differ from the last frame. SurfaceFlinger
+ * reports a single empty rect for untouched layers and no rects when it does
+ * not know, front-buffered layers report damage on an unchanged handle.
+ */
+static bool layer_damaged(const hwc_layer_1_t *layer)
+{
+    if (layer->surfaceDamage.numRects != 1)
+        return true;
+
+    const hwc_rect_t *rect = &layer->surfaceDamage.rects[0];
+    return rect->left < rect->right && rect->top < rect->bottom;
+}
+
 static long time_to_sleep_to_next_vsync(struct timespec *rt, uint64_t last_vsync_ns, unsigned vsync_period_ns)
 {
     uint64_t now = (uint64_t)rt->tv_sec * 1e9 + rt->tv_nsec;
@@ -408,6 +696,87 @@ static const struct wp_presentation_feedback_listener feedback_listener = {
     feedback_discarded
 };
 
+/*
+ * Runs on SurfaceFlinger's thread, which owns the windows and buffers.
+ * The first call drops everything that belonged to the lost connection,
+ * then the compositor is retried every RECONNECT_INTERVAL_NS and the
+ * windows are rebuilt from what was open before.
+ */
+static bool reconnect_wayland(struct waydroid_hwc_composer_device_1 *pdev)
+{
+    struct display *display = pdev->display;
+
+    if (!pdev->connection_lost) {
+        for (auto const& [name, window] : pdev->windows) {
+            if (!window)
+                continue;
+            if (!window->closed)
+                pdev->lost_windows.push_back({name, window->appID, window->taskID, window->bg_color});
+            destroy_window(window.get());
+        }
+        pdev->windows.clear();
+        for (auto const& [handle, buf] : display->buffer_map)
+            destroy_buffer(buf);
+        display->buffer_map.clear();
+        pdev->congested = false;
+        pdev->connection_lost = true;
+    }
+
+    if (pdev->frame_time_ns - pdev->last_reconnect_ns < RECONNECT_INTERVAL_NS)
+        return false;
+    pdev->last_reconnect_ns = pdev->frame_time_ns;
+
+    int width = floor(display->width * display->scale);
+    int height = floor(display->height * display->scale);
+    if (!reconnect_display(display))
+        return false;
+    ALOGI("Reconnected to the Wayland compositor, restoring %zu windows", pdev->lost_windows.size());
+
+    // Size and scale are derived again, the same way as in hwc_open
+    choose_width_height(display, 0, 0);
+    auto first_window = create_window(display, pdev->use_subsurface, "Waydroid", "0", {0, 0, 0, 255});
+    if (floor(display->width * display->scale) != width || floor(display->height * display->scale) != height)
+        ALOGW("Compositor size changed to %dx%d, Android keeps using %dx%d until restarted",
+              (int)floor(display->width * display->scale), (int)floor(display->height * display->scale),
+              width, height);
+
+    for (auto const& lost : pdev->lost_windows) {
+        if (lost.name == "Waydroid" && first_window) {
+            pdev->windows[lost.name] = first_window;
+            first_window = nullptr;
+        } else {
+            pdev->windows[lost.name] = create_window(display, pdev->use_subsurface,
+                                                     lost.appID, lost.taskID, lost.color);
+        }
+    }
+    if (first_window)
+        destroy_window(first_window.get());
+    pdev->lost_windows.clear();
+    std::string windows_size_str = std::to_string(pdev->windows.size());
+    property_set("waydroid.open_windows", windows_size_str.c_str());
+
+    // The Wayland thread is still parked, so configures can be waited for here
+    wl_display_roundtrip(display->display);
+    prewarm_windows(display, pdev->use_subsurface, display->window_pool_size);
+
+    if (display->refresh > 1000 && display->refresh < 1000000)
+        pdev->vsync_period_ns = 1000 * 1000 * 1000 / (display->refresh / 1000);
+    display->geo_changed = true;
+    pdev->connection_lost = false;
+    pdev->reconnects++;
+
+    {
+        std::scoped_lock lock(display->connection_mutex);
+        display->connection_state = WAYLAND_CONNECTED;
+    }
+    display->connection_cond.notify_all();
+
+    // This frame is gone, ask SF for one with everything on screen
+    if (pdev->procs && pdev->procs->invalidate)
+        pdev->procs->invalidate(pdev->procs);
+    return true;
+}
+
 static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
                    hwc_display_contents_1_t** displays) {
     char property[PROPERTY_VALUE_MAX];
@@ -420,6 +789,22 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
     hwc_display_contents_1_t* contents = displays[HWC_DISPLAY_PRIMARY];
     size_t fb_target = -1;
     int err = 0;
+    int ret;
+
+#ifdef HWC_COUNT_ALLOCATIONS
+    // Same windows, layers and buffers as the last frame means nothing may allocate
+    uint64_t allocations = tls_allocations;
+    bool steady = !pdev->display->geo_changed;
+    size_t window_count = pdev->windows.size();
+    size_t surface_count = pdev->display->layers.size();
+    size_t buffer_count = pdev->display->buffer_map.size();
+#endif
+
+    pdev->frame_time_ns = monotonic_ns();
+    pdev->frame_requests = 0;
+    pdev->frame_requests_skipped = 0;
+    read_layer_metadata(pdev->display);
+    snapshot_layers(&pdev->display->layer_slots, contents->numHwLayers);
 
     if (pdev->display->geo_changed) {
         for (auto it = pdev->display->buffer_map.begin(); it != pdev->display->buffer_map.end(); it++) {
@@ -430,10 +815,12 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         pdev->display->buffer_map.clear();
     }
 
+    // Skipped layers and the ones hwc_prepare left to SurfaceFlinger
     std::pair<int, int> skipped(-1, -1);
     if (pdev->use_subsurface && !pdev->multi_windows) {
         for (size_t i = 0; i < contents->numHwLayers; i++) {
-          if (!(contents->hwLayers[i].flags & HWC_SKIP_LAYER))
+          if (!(contents->hwLayers[i].flags & HWC_SKIP_LAYER) &&
+              contents->hwLayers[i].compositionType != HWC_FRAMEBUFFER)
             continue;
 
           if (skipped.first == -1)
@@ -458,16 +845,16 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
      * "AppID": Shows apps in related windows as explained above
      */
     property_get("waydroid.active_apps", property, "none");
-    std::string active_apps = std::string(property);
-    property_get("waydroid.blacklist_apps", property, "com.android.launcher3");
-    std::string blacklist_apps = std::string(property);
-    std::string single_layer_tid;
-    std::string single_layer_aid;
+    std::string_view active_apps = property;
+    update_blacklist(pdev);
+    // Point into the frame's layer snapshot
+    std::string_view single_layer_tid;
+    std::string_view single_layer_aid;
+    struct window *active_window = NULL;
 
     if (active_apps != "Waydroid" && !property_get_bool("waydroid.background_start", true)) {
         for (size_t l = 0; l < contents->numHwLayers; l++) {
-            std::string layer_name = pdev->display->layer_names[l];
-            if (layer_name.rfind("BootAnimation#", 0) == 0) {
+            if (!strcmp(frame_layer(pdev->display, l).rawName, "BootAnimation")) {
                 // force single window mode during boot animation
                 active_apps = "Waydroid";
                 break;
@@ -475,12 +862,53 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         }
     }
 
-    std::scoped_lock lock(pdev->display->windowsMutex);
+    // Nothing reaches the screen until the compositor is back
+    if (pdev->display->connection_state != WAYLAND_CONNECTED) {
+        reconnect_wayland(pdev);
+        for (size_t layer = 0; layer < contents->numHwLayers; layer++) {
+            hwc_layer_1_t* fb_layer = &contents->hwLayers[layer];
+            if (fb_layer->acquireFenceFd != -1)
+                close(fb_layer->acquireFenceFd);
+        }
+        goto sync;
+    }
+
+    /*
+     * The compositor didn't take the last frame yet. Queueing more requests
+     * on top only grows libwayland's buffer until the connection dies, so
+     * this frame is dropped. The next one sends whatever changed since the
+     * last frame that went out.
+     */
+    if (pdev->congested) {
+        if (flush_display(pdev->display, 0) == -EAGAIN) {
+            for (size_t layer = 0; layer < contents->numHwLayers; layer++) {
+                hwc_layer_1_t* fb_layer = &contents->hwLayers[layer];
+                if (fb_layer->acquireFenceFd != -1)
+                    close(fb_layer->acquireFenceFd);
+            }
+            pdev->dropped_frames++;
+            goto sync;
+        }
+        pdev->congested = false;
+    }
+
+    if (!pdev->first_frame_logged) {
+        pdev->first_frame_logged = true;
+        ALOGI("hwc_set: first frame %" PRId64 " ms after hwc_open",
+              (pdev->frame_time_ns - pdev->open_ns) / 1000000);
+    }
+
+    // Windows the compositor asked to close, see xdg_toplevel_handle_close
+    for (auto const& [name, window] : pdev->windows) {
+        if (window && window->closed && window->isActive)
+            destroy_window(window.get());
+    }
+
     if (active_apps == "none") {
         // Clear all open windows
         for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++) {
             if (it->second)
-                destroy_window(it->second);
+                destroy_window(it->second.get());
         }
         pdev->windows.clear();
         for (size_t layer = 0; layer < contents->numHwLayers; layer++) {
@@ -493,42 +921,35 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         goto sync;
     } else if (active_apps == "Waydroid") {
         // Clear all open windows if there's any and just keep "Waydroid"
-        if (pdev->windows.find(active_apps) == pdev->windows.end() || !pdev->windows[active_apps]->isActive) {
+        active_window = find_window(pdev, active_apps);
+        if (!active_window || !active_window->isActive) {
             for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++) {
                 if (it->second) {
-                    destroy_window(it->second);
+                    destroy_window(it->second.get());
                 }
             }
             pdev->windows.clear();
         } else {
-            pdev->windows[active_apps]->lastLayer = 0;
-            pdev->windows[active_apps]->last_layer_buffer = nullptr;
+            active_window->lastLayer = 0;
+            active_window->last_layer_buffer = nullptr;
         }
     } else if (!pdev->multi_windows) {
         // Single window mode, detecting if any unblacklisted app is on screen
         bool showWindow = false;
         for (size_t l = 0; l < contents->numHwLayers; l++) {
-            std::string layer_name = pdev->display->layer_names[l];
-            if (layer_name.substr(0, 4) == "TID:") {
-                std::string layer_tid = layer_name.substr(4, layer_name.find('#') - 4);
-                std::string layer_aid = layer_name.substr(layer_name.find('#') + 1, layer_name.find('/') - layer_name.find('#') - 1);
-                
-                std::istringstream iss(blacklist_apps);
-                std::string app;
-                while (std::getline(iss, app, ':')) {
-                    if (app == layer_aid) {
-                        showWindow = false;
-                        break;
-                    } else {
-                        showWindow = true;
-                        if (!single_layer_tid.length()) {
-                            single_layer_tid = layer_tid;
-                            single_layer_aid = layer_aid;
-                        }
-                        if (pdev->windows.find(single_layer_tid) != pdev->windows.end()) {
-                            pdev->windows[single_layer_tid]->lastLayer = 0;
-                            pdev->windows[single_layer_tid]->last_layer_buffer = nullptr;
-                        }
+            const struct layerInfo &layer_info = frame_layer(pdev->display, l);
+            if (layer_info.tid[0]) {
+                // The topmost app decides whether anything is shown
+                showWindow = !is_blacklisted(pdev, layer_info.aid);
+                if (showWindow) {
+                    if (!single_layer_tid.length()) {
+                        single_layer_tid = layer_info.tid;
+                        single_layer_aid = layer_info.aid;
+                    }
+                    active_window = find_window(pdev, single_layer_tid);
+                    if (active_window) {
+                        active_window->lastLayer = 0;
+                        active_window->last_layer_buffer = nullptr;
                     }
                 }
             }
@@ -537,7 +958,7 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         if (!showWindow) {
             for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++) {
                 if (it->second)
-                    destroy_window(it->second);
+                    destroy_window(it->second.get());
             }
             pdev->windows.clear();
             for (size_t layer = 0; layer < contents->numHwLayers; layer++) {
@@ -555,17 +976,15 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
                 // This window is closed, but android is still showing leftover layers, we detect it here
                 if (!it->second->isActive || it->first == "Waydroid") {
                     for (size_t l = 0; l < contents->numHwLayers; l++) {
-                        std::string layer_name = pdev->display->layer_names[l];
-                        if (layer_name.substr(0, 4) == "TID:") {
-                            std::string layer_tid = layer_name.substr(4, layer_name.find('#') - 4);
-                            if (layer_tid == it->first) {
+                        if (frame_layer(pdev->display, l).tid[0]) {
+                            if (it->first == frame_layer(pdev->display, l).tid) {
                                 shouldCloseLeftover = false;
                                 break;
                             }
                         }
                     }
                     if (shouldCloseLeftover) {
-                        destroy_window(it->second);
+                        destroy_window(it->second.get());
                         pdev->windows.erase(it++);
                         shouldCloseLeftover = true;
                         std::string windows_size_str = std::to_string(pdev->windows.size());
@@ -583,20 +1002,16 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         for (auto it = pdev->windows.cbegin(); it != pdev->windows.cend();) {
             bool foundApp = false;
             for (size_t l = 0; l < contents->numHwLayers; l++) {
-                std::string layer_name = pdev->display->layer_names[l];
-                if (layer_name.substr(0, 4) == "TID:") {
-                    std::string layer_tid = layer_name.substr(4, layer_name.find('#') - 4);
-                    if (layer_tid == it->first) {
+                const struct layerInfo &layer_info = frame_layer(pdev->display, l);
+                if (layer_info.tid[0]) {
+                    if (it->first == layer_info.tid) {
                         it->second->lastLayer = 0;
                         it->second->last_layer_buffer = nullptr;
                         foundApp = true;
                         break;
                     }
                 } else {
-                    std::string LayerRawName;
-                    std::istringstream issLayer(layer_name);
-                    std::getline(issLayer, LayerRawName, '#');
-                    if (LayerRawName == it->first) {
+                    if (it->first == layer_info.rawName) {
                         it->second->lastLayer = 0;
                         it->second->last_layer_buffer = nullptr;
                         foundApp = true;
@@ -607,7 +1022,7 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
             // This window ID doesn't match with any selected app IDs from prop, so kill it
             if (!foundApp || (it->second && !it->second->isActive)) {
                 if (it->second)
-                    destroy_window(it->second);
+                    destroy_window(it->second.get());
                 pdev->windows.erase(it++);
                 std::string windows_size_str = std::to_string(pdev->windows.size());
                 property_set("waydroid.open_windows", windows_size_str.c_str());
@@ -664,59 +1079,45 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         }
 
         struct window *window = NULL;
-        std::string layer_name = pdev->display->layer_names[layer];
+        const struct layerInfo &layer_info = frame_layer(pdev->display, layer);
 
         if (active_apps == "Waydroid") {
             // Show everything in a single window
-            if (pdev->windows.find(active_apps) == pdev->windows.end()) {
-                pdev->windows[active_apps] = create_window(pdev->display, pdev->use_subsurface, active_apps, "0", {0, 0, 0, 255});
+            window = find_window(pdev, active_apps);
+            if (!window) {
+                std::string name(active_apps);
+                pdev->windows[name] = create_window(pdev->display, pdev->use_subsurface, name, "0", {0, 0, 0, 255});
+                window = pdev->windows[name].get();
                 std::string windows_size_str = std::to_string(pdev->windows.size());
                 property_set("waydroid.open_windows", windows_size_str.c_str());
             }
-            window = pdev->windows[active_apps];
         } else if (!pdev->multi_windows) {
             if (single_layer_tid.length()) {
-                if (pdev->windows.find(single_layer_tid) == pdev->windows.end()) {
-                    pdev->windows[single_layer_tid] = create_window(pdev->display, pdev->use_subsurface, single_layer_aid, single_layer_tid, {0, 0, 0, 255});
+                window = find_window(pdev, single_layer_tid);
+                if (!window) {
+                    std::string tid(single_layer_tid);
+                    pdev->windows[tid] = create_window(pdev->display, pdev->use_subsurface, std::string(single_layer_aid), tid, {0, 0, 0, 255});
+                    window = pdev->windows[tid].get();
                     std::string windows_size_str = std::to_string(pdev->windows.size());
                     property_set("waydroid.open_windows", windows_size_str.c_str());
                 }
-                window = pdev->windows[single_layer_tid];
             }
         } else {
-            // Create windows based on Task ID in layer name
-            if (layer_name.substr(0, 4) == "TID:") {
-                std::string layer_tid = layer_name.substr(4, layer_name.find('#') - 4);
-                std::string layer_aid = layer_name.substr(layer_name.find('#') + 1, layer_name.find('/') - layer_name.find('#') - 1);
-
-                bool showWindow = false;
-                std::istringstream iss(blacklist_apps);
-                std::string app;
-                while (std::getline(iss, app, ':')) {
-                    if (app == layer_aid) {
-                        showWindow = false;
-                        break;
-                    } else
-                        showWindow = true;
-                }
-
-                if (showWindow) {
-                    if (pdev->windows.find(layer_tid) == pdev->windows.end()) {
-                        pdev->windows[layer_tid] = create_window(pdev->display, pdev->use_subsurface, layer_aid, layer_tid, {0, 0, 0, 0});
-                        std::string windows_size_str = std::to_string(pdev->windows.size());
-                        property_set("waydroid.open_windows", windows_size_str.c_str());
-                    }
-                    if (pdev->windows.find(layer_tid) != pdev->windows.end())
-                        window = pdev->windows[layer_tid];
+            // Create windows based on the task of the layer
+            if (layer_info.tid[0] && !is_blacklisted(pdev, layer_info.aid)) {
+                window = find_window(pdev, layer_info.tid);
+                if (!window) {
+                    pdev->windows[layer_info.tid] = create_window(pdev->display, pdev->use_subsurface, layer_info.aid, layer_info.tid, {0, 0, 0, 0});
+                    window = pdev->windows[layer_info.tid].get();
+                    std::string windows_size_str = std::to_string(pdev->windows.size());
+                    property_set("waydroid.open_windows", windows_size_str.c_str());
                 }
             }
         }
 
         // Detecting cursor layer
         if (!window) {
-            std::string LayerRawName;
-            std::istringstream issLayer(layer_name);
-            std::getline(issLayer, LayerRawName, '#');
+            std::string_view LayerRawName = layer_info.rawName;
             if (LayerRawName == "Sprite" && pdev->display->pointer_surface) {
                 if (pdev->display->cursor_surface) {
                     struct buffer *buf = get_wl_buffer(pdev, fb_layer, layer);
@@ -750,12 +1151,12 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
                     for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++) {
                         if (it->second) {
                             if (it->second->surface == pdev->display->pointer_surface) {
-                                window = it->second;
+                                window = it->second.get();
                                 break;
                             }
-                            for (auto itt = it->second->surfaces.begin(); itt != it->second->surfaces.end(); itt++) {
-                                if (itt->second == pdev->display->pointer_surface) {
-                                    window = it->second;
+                            for (size_t l = 0; l < it->second->surfaceCount; l++) {
+                                if (it->second->surfaces[l] == pdev->display->pointer_surface) {
+                                    window = it->second.get();
                                     break;
                                 }
                             }
@@ -764,22 +1165,34 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
                 }
             }
             if (LayerRawName == "InputMethod") {
-                if (pdev->windows.find(LayerRawName) == pdev->windows.end()) {
-                    pdev->windows[LayerRawName] = create_window(pdev->display, pdev->use_subsurface, LayerRawName, "none", {0, 0, 0, 0});
+                window = find_window(pdev, LayerRawName);
+                if (!window) {
+                    std::string name(LayerRawName);
+                    pdev->windows[name] = create_window(pdev->display, pdev->use_subsurface, name, "none", {0, 0, 0, 0});
+                    window = pdev->windows[name].get();
                     std::string windows_size_str = std::to_string(pdev->windows.size());
                     property_set("waydroid.open_windows", windows_size_str.c_str());
                 }
-                if (pdev->windows.find(LayerRawName) != pdev->windows.end())
-                    window = pdev->windows[LayerRawName];
             }
         }
 
-        if (!window || !window->isActive) {
+        if (!window || !window->isActive || window->closed) {
+            if (fb_layer->acquireFenceFd != -1) {
+                close(fb_layer->acquireFenceFd);
+            }
+            continue;
+        }
+
+        // Windows are created asynchronously, nothing may be attached
+        // before the compositor's first configure was acked
+        if (!window->configured) {
             if (fb_layer->acquireFenceFd != -1) {
                 close(fb_layer->acquireFenceFd);
             }
             continue;
         }
+        if (!window->bg_ready)
+            setup_window_background(window);
 
         struct buffer *buf = get_wl_buffer(pdev, fb_layer, layer);
         if (!buf) {
@@ -793,59 +1206,75 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         // TODO: Implement per-layer explicit synchronization
         fb_layer->releaseFenceFd = -1;
 
-        struct wl_surface *surface = get_surface(pdev, fb_layer, window, pdev->use_subsurface);
+        struct surfaceState *state;
+        bool dirty;
+        struct wl_surface *surface = get_surface(pdev, fb_layer, window, pdev->use_subsurface, &state, &dirty);
         if (!surface) {
             ALOGE("Failed to get surface");
+            if (fb_layer->acquireFenceFd != -1) {
+                close(fb_layer->acquireFenceFd);
+            }
             continue;
         }
         window->last_layer_buffer = buf;
         window->lastLayer++;
 
-        wl_surface_attach(surface, buf->buffer, 0, 0);
-        if (wl_surface_get_version(surface) >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
-            wl_surface_damage_buffer(surface, 0, 0, buf->width, buf->height);
-        else
-            wl_surface_damage(surface, 0, 0, buf->width, buf->height);
+        // The same buffer only needs no new attach when SurfaceFlinger reports
+        // no damage, front-buffered and shared-buffer layers redraw in place.
+        // SHM copies are refreshed in place and always need a new commit, and
+        // wl_buffers are recreated on geometry changes.
+        bool changed = dirty;
+        if (state->buffer != buf->buffer || buf->isShm || pdev->display->geo_changed ||
+            layer_damaged(fb_layer)) {
+            wl_surface_attach(surface, buf->buffer, 0, 0);
+            if (wl_surface_get_version(surface) >= WL_SURFACE_DAMAGE_BUFFER_SINCE_VERSION)
+                wl_surface_damage_buffer(surface, 0, 0, buf->width, buf->height);
+            else
+                wl_surface_damage(surface, 0, 0, buf->width, buf->height);
+            pdev->frame_requests += 2;
+            changed = true;
+        } else {
+            pdev->frame_requests_skipped += 2;
+        }
         if (!pdev->display->viewporter && pdev->display->scale > 1) {
             // With no viewporter the scale is guaranteed to be integer
-            wl_surface_set_buffer_scale(surface, (int)pdev->display->scale);
+            int32_t scale = (int)pdev->display->scale;
+            if (!state->buffer || state->scale != scale) {
+                wl_surface_set_buffer_scale(surface, scale);
+                state->scale = scale;
+                pdev->frame_requests++;
+                changed = true;
+            } else {
+                pdev->frame_requests_skipped++;
+            }
         }
-        switch (fb_layer->transform) {
-            case HWC_TRANSFORM_FLIP_H:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_FLIPPED_180);
-                break;
-            case HWC_TRANSFORM_FLIP_V:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_FLIPPED);
-                break;
-            case HWC_TRANSFORM_ROT_90:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_90);
-                break;
-            case HWC_TRANSFORM_ROT_180:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_180);
-                break;
-            case HWC_TRANSFORM_ROT_270:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_270);
-                break;
-            case HWC_TRANSFORM_FLIP_H_ROT_90:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_FLIPPED_270);
-                break;
-            case HWC_TRANSFORM_FLIP_V_ROT_90:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_FLIPPED_90);
-                break;
-            default:
-                wl_surface_set_buffer_transform(surface, WL_OUTPUT_TRANSFORM_NORMAL);
-                break;
+        int32_t transform = wl_transform(fb_layer->transform);
+        if (!state->buffer || state->transform != transform) {
+            wl_surface_set_buffer_transform(surface, transform);
+            state->transform = transform;
+            pdev->frame_requests++;
+            changed = true;
+        } else {
+            pdev->frame_requests_skipped++;
         }
+        state->buffer = buf->buffer;
+
+        if (changed) {
+            struct wp_presentation *pres = window->display->presentation;
+            if (pres) {
+                buf->feedback = wp_presentation_feedback(pres, surface);
+                wp_presentation_feedback_add_listener(buf->feedback,
+                                  &feedback_listener, pdev);
+                pdev->frame_requests++;
+            }
 
-        struct wp_presentation *pres = window->display->presentation;
-        if (pres) {
-            buf->feedback = wp_presentation_feedback(pres, surface);
-            wp_presentation_feedback_add_listener(buf->feedback,
-                              &feedback_listener, pdev);
+            wl_surface_commit(surface);
+            window->parentDirty = true;
+            pdev->frame_requests++;
+        } else {
+            pdev->frame_requests_skipped++;
         }
 
-        wl_surface_commit(surface);
-
         if (window->snapshot_buffer) {
             // Snapshot buffer should be detached by now, clean up
             destroy_buffer(window->snapshot_buffer);
@@ -868,22 +1297,31 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
                 if (!it->second->lastLayer)
                     continue;
                 // Neutralize unused surfaces
-                for (size_t l = it->second->lastLayer; l < it->second->surfaces.size(); l++) {
-                    if (it->second->surfaces.find(l) != it->second->surfaces.end()) {
-                        wl_surface_attach(it->second->surfaces[l], NULL, 0, 0);
-                        wl_surface_commit(it->second->surfaces[l]);
-                    }
+                for (size_t l = it->second->lastLayer; l < it->second->surfaceCount; l++) {
+                    if (!it->second->surfaceStates[l].buffer)
+                        continue;
+                    wl_surface_attach(it->second->surfaces[l], NULL, 0, 0);
+                    wl_surface_commit(it->second->surfaces[l]);
+                    it->second->surfaceStates[l].buffer = NULL;
+                    it->second->parentDirty = true;
+                    pdev->frame_requests += 2;
                 }
             }
         }
         pdev->display->geo_changed = false;
     }
 
+    // Hand subsurfaces that stayed unused for a while back to the pool
+    for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++)
+        if (it->second)
+            trim_layer_surfaces(it->second.get(), pdev->frame_time_ns);
+    trim_surface_pool(pdev->display, pdev->frame_time_ns);
+
     if (!pdev->multi_windows && single_layer_tid.length() && active_apps != "Waydroid") {
         for (auto const& [layer_tid, window] : pdev->windows) {
             // Replace inactive app window buffer with snapshot in staged mode
             if (layer_tid != single_layer_tid && !window->snapshot_buffer) {
-                pdev->display->egl_work_queue.push_back(std::bind(snapshot_inactive_app_window, pdev->display, window));
+                pdev->display->egl_work_queue.push_back(std::bind(snapshot_inactive_app_window, pdev->display, window.get()));
             }
         }
         if (!pdev->display->egl_work_queue.empty()) {
@@ -892,16 +1330,51 @@ static int hwc_set(struct hwc_composer_device_1* dev,size_t numDisplays,
         }
     }
 
-    if (pdev->use_subsurface)
-        for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++)
-            if (it->second)
-                wl_surface_commit(it->second->surface);
-    wl_display_flush(pdev->display->display);
+    // Parents only need a commit for subsurface changes or a pending configure ack
+    for (auto it = pdev->windows.begin(); it != pdev->windows.end(); it++) {
+        if (!it->second)
+            continue;
+        bool dirty = pdev->use_subsurface && it->second->parentDirty;
+        if (it->second->ackPending.exchange(false) || dirty) {
+            wl_surface_commit(it->second->surface);
+            pdev->frame_requests++;
+        } else if (pdev->use_subsurface) {
+            pdev->frame_requests_skipped++;
+        }
+        it->second->parentDirty = false;
+    }
+
+    // Wait up to a frame for the socket, a slow compositor then slows SF down
+    ret = flush_display(pdev->display, pdev->flush_timeout_ms);
+    if (ret == -EAGAIN) {
+        pdev->congested = true;
+        pdev->congested_frames++;
+    } else if (ret < 0) {
+        ALOGE("Failed to flush the wayland display: %s", strerror(-ret));
+    }
+
+    pdev->last_frame_requests = pdev->frame_requests;
+    pdev->last_frame_requests_skipped = pdev->frame_requests_skipped;
+    pdev->total_requests += pdev->frame_requests;
+    pdev->total_requests_skipped += pdev->frame_requests_skipped;
+    pdev->counted_frames++;
 
 sync:
     sw_sync_timeline_inc(pdev->timeline_fd, 1);
     contents->retireFenceFd = sw_sync_fence_create(pdev->timeline_fd, "hwc_contents_release", ++pdev->next_sync_point);
 
+#ifdef HWC_COUNT_ALLOCATIONS
+    if (steady && window_count == pdev->windows.size() &&
+        surface_count == pdev->display->layers.size() &&
+        buffer_count == pdev->display->buffer_map.size() &&
+        tls_allocations != allocations) {
+        pdev->steady_state_allocations += tls_allocations - allocations;
+        LOG_ALWAYS_FATAL_IF(pdev->steady_state_allocations_fatal,
+                            "hwc_set allocated %" PRIu64 " times in steady state",
+                            tls_allocations - allocations);
+    }
+#endif
+
     return err;
 }
 
@@ -944,10 +1417,39 @@ static int hwc_blank(struct hwc_composer_device_1* dev __unused, int disp __unus
     return 0;
 }
 
-static void hwc_dump(hwc_composer_device_1* dev __unused, char* buff __unused,
-                     int buff_len __unused) {
+static void hwc_dump(hwc_composer_device_1* dev, char* buff, int buff_len) {
     // This is run when running dumpsys.
-    // No-op for now.
+    struct waydroid_hwc_composer_device_1* pdev = (struct waydroid_hwc_composer_device_1*)dev;
+    struct lockStats *stats = &pdev->display->windowsLockStats;
+
+    uint64_t acquired = stats->acquired;
+    uint64_t frames = pdev->counted_frames;
+    snprintf(buff, buff_len,
+             "Waydroid HWC\n"
+             "  windows: %zu\n"
+             "  window registry lock: %" PRIu64 " acquired, %" PRIu64 " contended, "
+             "%" PRIu64 " us avg held, %" PRIu64 " us max held\n"
+             "  wayland requests per frame: %u last (%u skipped), "
+             "%" PRIu64 " avg (%" PRIu64 " skipped) over %" PRIu64 " frames\n"
+             "  compositor congested: %" PRIu64 " frames, %" PRIu64 " dropped\n"
+             "  wayland reconnects: %" PRIu64 "%s\n",
+             get_windows(pdev->display)->size(),
+             acquired, stats->contended.load(),
+             acquired ? stats->held_ns / acquired / 1000 : 0,
+             stats->max_held_ns / 1000,
+             pdev->last_frame_requests.load(), pdev->last_frame_requests_skipped.load(),
+             frames ? pdev->total_requests / frames : 0,
+             frames ? pdev->total_requests_skipped / frames : 0,
+             frames,
+             pdev->congested_frames.load(), pdev->dropped_frames.load(),
+             pdev->reconnects.load(),
+             pdev->display->connection_state == WAYLAND_CONNECTED ? "" : ", disconnected");
+#ifdef HWC_COUNT_ALLOCATIONS
+    size_t len = strlen(buff);
+    snprintf(buff + len, buff_len - len,
+             "  steady state allocations in hwc_set: %" PRIu64 "\n",
+             pdev->steady_state_allocations);
+#endif
 }
 
 
@@ -1043,14 +1545,29 @@ static int hwc_close(hw_device_t* dev) {
 
 static void* hwc_wayland_thread(void* data) {
     struct waydroid_hwc_composer_device_1* pdev = (struct waydroid_hwc_composer_device_1*)data;
-    int ret = 0;
+    struct display *display = pdev->display;
 
     setpriority(PRIO_PROCESS, 0, HAL_PRIORITY_URGENT_DISPLAY);
 
-    while (ret != -1)
-        ret = wl_display_dispatch(pdev->display->display);
-
-    ALOGE("*** %s: Wayland client was disconnected: %s", __PRETTY_FUNCTION__, strerror(ret));
+    while (true) {
+        while (wl_display_dispatch(display->display) != -1)
+            ;
+
+        ALOGE("*** %s: Wayland client was disconnected: %s", __PRETTY_FUNCTION__, strerror(errno));
+
+        /*
+         * hwc_set reconnects, as it owns the windows. Vsync keeps going on
+         * its own, and SurfaceFlinger is nudged so hwc_set gets to run even
+         * when nothing on screen changes.
+         */
+        std::unique_lock lock(display->connection_mutex);
+        display->connection_state = WAYLAND_DISCONNECTED;
+        while (!display->connection_cond.wait_for(lock, std::chrono::nanoseconds(RECONNECT_INTERVAL_NS),
+                                                  [display] { return display->connection_state == WAYLAND_CONNECTED; })) {
+            if (pdev->procs && pdev->procs->invalidate)
+                pdev->procs->invalidate(pdev->procs);
+        }
+    }
 
     return NULL;
 }
@@ -1119,10 +1636,20 @@ static void hwc_register_procs(struct hwc_composer_device_1* dev,
     pdev->procs = procs;
 }
 
+// Ends a startup phase, timings go to systrace and the log
+static void boot_phase_end(int64_t *since, const char *phase)
+{
+    int64_t now = monotonic_ns();
+    ATRACE_END();
+    ALOGI("hwc_open: %s took %" PRId64 " us", phase, (now - *since) / 1000);
+    *since = now;
+}
+
 static int hwc_open(const struct hw_module_t* module, const char* name,
                     struct hw_device_t** device) {
     int ret = 0;
     char property[PROPERTY_VALUE_MAX];
+    int64_t phase_start = monotonic_ns();
 
     if (strcmp(name, HWC_HARDWARE_COMPOSER)) {
         ALOGE("%s called with bad name %s", __FUNCTION__, name);
@@ -1154,6 +1681,10 @@ static int hwc_open(const struct hw_module_t* module, const char* name,
 
     pdev->multi_windows = property_get_bool("persist.waydroid.multi_windows", false);
     pdev->use_subsurface = property_get_bool("persist.waydroid.use_subsurface", false) || pdev->multi_windows;
+#ifdef HWC_COUNT_ALLOCATIONS
+    // Turns a steady state allocation into a crash, for testing
+    pdev->steady_state_allocations_fatal = property_get_bool("waydroid.debug.hwc_alloc_fatal", false);
+#endif
     pdev->timeline_fd = sw_sync_timeline_create();
     pdev->next_sync_point = 1;
 
@@ -1163,14 +1694,22 @@ static int hwc_open(const struct hw_module_t* module, const char* name,
     if (property_get("waydroid.wayland_display", property, "wayland-0") > 0) {
         setenv("WAYLAND_DISPLAY", property, 1);
     }
+    pdev->open_ns = phase_start;
+    ATRACE_BEGIN("hwc_open: connect");
     if (property_get("ro.hardware.gralloc", property, "default") > 0) {
         pdev->display = create_display(property);
     }
     if (!pdev->display) {
+        ATRACE_END();
         ALOGE("failed to open wayland connection");
         return -ENODEV;
     }
     ALOGE("wayland display %p", pdev->display);
+    boot_phase_end(&phase_start, "connect");
+
+    // Per-layer subsurfaces idle this long go back to the pool, then get destroyed
+    pdev->display->surface_idle_ns =
+            property_get_int32("persist.waydroid.surface_idle_ms", 10000) * 1000000LL;
 
     pthread_mutex_init(&pdev->vsync_lock, NULL);
     pdev->vsync_callback_enabled = true;
@@ -1178,18 +1717,28 @@ static int hwc_open(const struct hw_module_t* module, const char* name,
     // Initialize width and height with user-provided overrides if any
     choose_width_height(pdev->display, 0, 0);
 
+    ATRACE_BEGIN("hwc_open: first window");
     auto first_window = create_window(pdev->display, pdev->use_subsurface, "Waydroid", "0", {0, 0, 0, 255});
     if (!property_get_bool("waydroid.background_start", true)) {
         pdev->windows["Waydroid"] = first_window;
         property_set("waydroid.active_apps", "Waydroid");
         property_set("waydroid.open_windows", "1");
     } else {
-        destroy_window(first_window);
+        destroy_window(first_window.get());
     }
+    boot_phase_end(&phase_start, "first window");
+
+    // Keep a few surfaces around so opening apps doesn't stall composition
+    prewarm_windows(pdev->display, pdev->use_subsurface,
+                    property_get_int32("persist.waydroid.window_pool_size", pdev->multi_windows ? 2 : 0));
 
     if (pdev->display->refresh > 1000 && pdev->display->refresh < 1000000)
         pdev->vsync_period_ns = 1000 * 1000 * 1000 / (pdev->display->refresh / 1000);
 
+    // How long hwc_set may block on a congested compositor, a frame by default
+    pdev->flush_timeout_ms = property_get_int32("persist.waydroid.flush_timeout_ms",
+                                                pdev->vsync_period_ns / 1000000);
+
     if (!property_get_bool("persist.waydroid.cursor_on_subsurface", false)) {
         pdev->display->cursor_surface =
             wl_compositor_create_surface(pdev->display->compositor);
@@ -1208,6 +1757,7 @@ static int hwc_open(const struct hw_module_t* module, const char* name,
 
     pdev->last_vsync_ns = int64_t(rt.tv_sec) * 1e9 + rt.tv_nsec;
 
+    ATRACE_BEGIN("hwc_open: threads");
     if (!pdev->vsync_thread) {
         ret = pthread_create (&pdev->vsync_thread, NULL, hwc_vsync_thread, pdev);
         if (ret) {
@@ -1235,6 +1785,18 @@ static int hwc_open(const struct hw_module_t* module, const char* name,
         ALOGE("waydroid_hw_composer could not start egl_worker_thread");
     }
 
+    ret = pthread_create(&pdev->window_worker_thread, NULL, window_worker_loop, pdev->display);
+    if (ret) {
+        ALOGE("waydroid_hw_composer could not start window_worker_thread");
+    }
+
+    // Also looks the task service up, so hwc_open doesn't wait for it
+    ret = pthread_create(&pdev->task_dispatch_thread, NULL, task_dispatch_loop, pdev->display);
+    if (ret) {
+        ALOGE("waydroid_hw_composer could not start task_dispatch_thread");
+    }
+    boot_phase_end(&phase_start, "threads");
+
     *device = &pdev->base.common;
 
     return ret;
@@ -0,0 +1,114 @@
+/*
+ * Copyright © 2026 Waydroid Project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Hammers the layer slot writers from several threads while hwc_set's
+ * reader snapshots the slots, and checks that no snapshot mixes two
+ * updates of the same slot.
+ */
+
+#include "layer-slots.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+#define TEST_LAYERS 8
+#define TEST_WRITERS 4
+
+// Every field of an update is derived from the same value
+static void fill_layer(struct layerInfo *info, uint32_t value)
+{
+    info->ext.format = value;
+    info->ext.stride = value * 2;
+    info->ext.width = value * 3;
+    info->ext.height = ~value;
+    memset(info->rawName, 'a' + value % 26, sizeof(info->rawName) - 1);
+    info->rawName[sizeof(info->rawName) - 1] = '\0';
+    snprintf(info->tid, sizeof(info->tid), "%u", value);
+    snprintf(info->aid, sizeof(info->aid), "app-%u", value);
+}
+
+static bool layer_consistent(const struct layerInfo *info)
+{
+    struct layerInfo expected;
+    static const struct layerInfo empty = {};
+
+    if (!memcmp(info, &empty, sizeof(empty)))
+        return true;
+
+    memset(&expected, 0, sizeof(expected));
+    fill_layer(&expected, info->ext.format);
+    return !memcmp(info, &expected, sizeof(expected));
+}
+
+TEST(LayerSlots, SnapshotsAreNeverTorn)
+{
+    std::unique_ptr<struct layerSlotTable> table(new struct layerSlotTable());
+    std::atomic<bool> stop(false);
+    std::atomic<uint32_t> next_value(1);
+    std::vector<std::thread> writers;
+    uint64_t snapshots = 0, torn = 0;
+
+    for (int w = 0; w < TEST_WRITERS; w++) {
+        writers.emplace_back([&, w]() {
+            uint32_t layer = w;
+            while (!stop.load(std::memory_order_relaxed)) {
+                uint32_t value = next_value++;
+                // the last index stands for the client target
+                layer = (layer + 1 + value % 3) % (TEST_LAYERS + 1);
+
+                std::scoped_lock lock(table->mutex);
+                struct layerSlot *slot = layer < TEST_LAYERS ?
+                        get_layer_slot(table.get(), layer) : &table->target;
+                struct layerInfo *info = begin_layer_update(slot);
+                fill_layer(info, value);
+                end_layer_update(slot);
+            }
+        });
+    }
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (std::chrono::steady_clock::now() < deadline) {
+        snapshot_layers(table.get(), TEST_LAYERS);
+        for (size_t l = 0; l < TEST_LAYERS; l++)
+            torn += !layer_consistent(&table->frame[l]);
+        torn += !layer_consistent(&table->frame_target);
+        snapshots++;
+    }
+
+    stop = true;
+    for (auto& writer : writers)
+        writer.join();
+
+    EXPECT_GT(snapshots, 0u);
+    EXPECT_GT(next_value.load(), (uint32_t)TEST_WRITERS);
+    EXPECT_EQ(torn, 0u);
+}
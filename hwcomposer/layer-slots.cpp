@@ -0,0 +1,94 @@
+/*
+ * Copyright © 2026 Waydroid Project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/*
+ * Layer metadata slots, written by the extension thread and read once per
+ * frame by hwc_set. Each slot is a seqlock: writers serialize on the
+ * table's mutex, the reader retries instead of blocking.
+ */
+
+#include "layer-slots.h"
+
+#include <string.h>
+#include <algorithm>
+
+struct layerSlot *
+get_layer_slot(struct layerSlotTable *table, uint32_t layer)
+{
+    if (layer >= MAX_LAYERS)
+        return NULL;
+    return &table->slots[layer];
+}
+
+// Writers hold the table's mutex, so there is only ever one per slot
+struct layerInfo *
+begin_layer_update(struct layerSlot *slot)
+{
+    slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return &slot->info;
+}
+
+void
+end_layer_update(struct layerSlot *slot)
+{
+    slot->seq.store(slot->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+void
+clear_layer_tasks(struct layerSlotTable *table)
+{
+    for (size_t l = 0; l < MAX_LAYERS; l++) {
+        struct layerSlot *slot = &table->slots[l];
+        // Only writers get here, so the slot can be looked at without retrying
+        if (!slot->info.tid[0] && !slot->info.aid[0])
+            continue;
+        struct layerInfo *info = begin_layer_update(slot);
+        info->tid[0] = '\0';
+        info->aid[0] = '\0';
+        end_layer_update(slot);
+    }
+}
+
+static void
+read_layer_slot(struct layerSlot *slot, struct layerInfo *info)
+{
+    uint32_t seq;
+    do {
+        seq = slot->seq.load(std::memory_order_acquire);
+        memcpy(info, &slot->info, sizeof(*info));
+        std::atomic_thread_fence(std::memory_order_acquire);
+    } while ((seq & 1) || seq != slot->seq.load(std::memory_order_relaxed));
+}
+
+// Never blocks on the writers and doesn't allocate
+void
+snapshot_layers(struct layerSlotTable *table, size_t count)
+{
+    count = std::min(count, (size_t)MAX_LAYERS);
+    for (size_t l = 0; l < count; l++)
+        read_layer_slot(&table->slots[l], &table->frame[l]);
+    read_layer_slot(&table->target, &table->frame_target);
+}
@@ -0,0 +1,77 @@
+/*
+ * Copyright © 2026 Waydroid Project.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining
+ * a copy of this software and associated documentation files (the
+ * "Software"), to deal in the Software without restriction, including
+ * without limitation the rights to use, copy, modify, merge, publish,
+ * distribute, sublicense, and/or sell copies of the Software, and to
+ * permit persons to whom the Software is furnished to do so, subject to
+ * the following conditions:
+ *
+ * The above copyright notice and this permission notice (including the
+ * next paragraph) shall be included in all copies or substantial
+ * portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+ * EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+ * MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT.  IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS
+ * BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN
+ * ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
+ * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+
+struct handleExt {
+    uint32_t format;
+    uint32_t stride;
+    uint32_t width;
+    uint32_t height;
+};
+
+#define MAX_LAYERS 128
+#define LAYER_NAME_MAX 64
+#define LAYER_APP_ID_MAX 128
+
+// Everything hwc_set needs to know about a layer, kept trivially copyable
+struct layerInfo {
+    struct handleExt ext;
+    char rawName[LAYER_NAME_MAX]; // layer name up to the first '#'
+    char tid[16];                 // empty for layers that don't belong to a task
+    char aid[LAYER_APP_ID_MAX];
+};
+
+// Seqlock protected, written by the extension thread and read by hwc_set
+struct layerSlot {
+    std::atomic<uint32_t> seq;
+    struct layerInfo info;
+};
+
+struct layerSlotTable {
+    // Layer metadata indexed by position, writers hold mutex
+    struct layerSlot slots[MAX_LAYERS];
+    struct layerSlot target;
+    std::mutex mutex;
+    // Copy taken at the start of hwc_set, only used from SurfaceFlinger's thread
+    struct layerInfo frame[MAX_LAYERS];
+    struct layerInfo frame_target;
+};
+
+struct layerSlot *
+get_layer_slot(struct layerSlotTable *table, uint32_t layer);
+struct layerInfo *
+begin_layer_update(struct layerSlot *slot);
+void
+end_layer_update(struct layerSlot *slot);
+void
+clear_layer_tasks(struct layerSlotTable *table);
+void
+snapshot_layers(struct layerSlotTable *table, size_t count);
@@ -43,6 +43,7 @@
 #include <fcntl.h>
 #include <getopt.h>
 #include <errno.h>
+#include <poll.h>
 #include <linux/input.h>
 #include <linux/memfd.h>
 #include <drm_fourcc.h>
@@ -75,6 +76,15 @@
 #include "fractional-scale-v1-client-protocol.h"
 
 using ::android::hardware::hidl_string;
+using ::android::hardware::hidl_vec;
+
+#if defined(WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION)
+#define WL_SEAT_MAX_VERSION (uint32_t)WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION
+#elif defined(WL_POINTER_AXIS_VALUE120_SINCE_VERSION)
+#define WL_SEAT_MAX_VERSION (uint32_t)WL_POINTER_AXIS_VALUE120_SINCE_VERSION
+#else
+#define WL_SEAT_MAX_VERSION (uint32_t)WL_POINTER_AXIS_SOURCE_SINCE_VERSION
+#endif
 
 struct buffer;
 
@@ -195,41 +205,56 @@ int ConvertHalFormatToDrm(struct display *display, uint32_t hal_format) {
             if (!isFormatSupported(display, fmt))
                 fmt = DRM_FORMAT_RGB565;
             break;
-        case HAL_PIXEL_FORMAT_YV12:
-            fmt = DRM_FORMAT_YVU420;
-            if (!isFormatSupported(display, fmt))
-                fmt = DRM_FORMAT_GR88;
-            break;
         default:
-            ALOGE("Cannot convert hal format to drm format %u", hal_format);
+            // Multi-planar formats need the plane layout, see create_dmabuf_wl_buffer
+            ALOGV("Cannot convert hal format to drm format %u", hal_format);
             return -EINVAL;
     }
     if (!isFormatSupported(display, fmt)) {
-        ALOGE("Current wayland display doesn't support hal format %u", hal_format);
+        ALOGV("Current wayland display doesn't support hal format %u", hal_format);
         return -EINVAL;
     }
     return fmt;
 }
 
+/*
+ * Import a dma-buf with the given planes. A negative format is derived from
+ * hal_format, which only works for single plane buffers. Fails without
+ * sending anything when the compositor doesn't support the format.
+ */
 int
 create_dmabuf_wl_buffer(struct display *display, struct buffer *buffer,
              int width, int height, int hal_format, int format,
-             int prime_fd, int pixel_stride, int byte_stride,
-             int offset, uint64_t modifier, buffer_handle_t target)
+             int num_planes, const int *fds, const uint32_t *offsets,
+             const uint32_t *strides, int pixel_stride, uint64_t modifier,
+             buffer_handle_t target)
 {
     struct zwp_linux_buffer_params_v1 *params;
 
-    assert(prime_fd >= 0);
+    if (num_planes < 1)
+        return -EINVAL;
+    if (format < 0)
+        format = (num_planes == 1) ? ConvertHalFormatToDrm(display, hal_format) : -EINVAL;
+    if (format < 0 || !isFormatSupported(display, format)) {
+        ALOGE("Cannot import a dma-buf of hal format %d", hal_format);
+        return -EINVAL;
+    }
+    for (int i = 0; i < num_planes; i++) {
+        if (fds[i] < 0)
+            return -EINVAL;
+    }
+
     buffer->hal_format = hal_format;
-    buffer->format = (format >= 0) ? format : ConvertHalFormatToDrm(display, hal_format);
-    assert(buffer->format >= 0);
+    buffer->format = format;
     buffer->width = width;
     buffer->height = height;
     buffer->pixel_stride = pixel_stride;
     buffer->handle = target;
 
     params = zwp_linux_dmabuf_v1_create_params(display->dmabuf);
-    zwp_linux_buffer_params_v1_add(params, prime_fd, 0, offset, byte_stride, modifier >> 32, modifier & 0xffffffff);
+    for (int i = 0; i < num_planes; i++) {
+        zwp_linux_buffer_params_v1_add(params, fds[i], i, offsets[i], strides[i], modifier >> 32, modifier & 0xffffffff);
+    }
     zwp_linux_buffer_params_v1_add_listener(params, &params_listener, buffer);
 
     buffer->buffer = zwp_linux_buffer_params_v1_create_immed(params, buffer->width, buffer->height, buffer->format, 0);
@@ -263,11 +288,14 @@ create_shm_wl_buffer(struct display *display, struct buffer *buffer,
     // Assume 4bpp formats or none of this is going to work
     int shm_stride = width * 4;
     int size = shm_stride * height;
+    int shm_format = ConvertHalFormatToShm(format);
+
+    if (shm_format < 0)
+        return shm_format;
 
     buffer->size = size;
     buffer->hal_format = format;
-    buffer->format = ConvertHalFormatToShm(format);
-    assert(buffer->format >= 0);
+    buffer->format = shm_format;
     buffer->width = width;
     buffer->height = height;
     buffer->pixel_stride = pixel_stride;
@@ -328,13 +356,20 @@ void snapshot_inactive_app_window(struct display *display, struct window *window
     wl_surface_commit(surface);
 
     window->snapshot_buffer = new_buf;
+    window->mainState.buffer = NULL;
 }
 
 static void
-xdg_surface_handle_configure(void *, struct xdg_surface *surface,
+xdg_surface_handle_configure(void *data, struct xdg_surface *surface,
                  uint32_t serial)
 {
+    struct window *window = (struct window *)data;
+
     xdg_surface_ack_configure(surface, serial);
+    // The ack is applied on the next commit, even if no buffer changes
+    window->ackPending = true;
+    // hwc_set may attach buffers from now on
+    window->configured = true;
 }
 
 static const struct xdg_surface_listener xdg_surface_listener = {
@@ -347,6 +382,7 @@ finished_computing_scale(struct display *d)
 {
     char property[PROPERTY_VALUE_MAX];
     int default_density = 180;
+    d->scale_published = true;
     std::string display_scale = std::to_string(d->scale);
     property_set("waydroid.display_scale", display_scale.c_str());
     if (property_get("ro.sf.lcd_density", property, nullptr) <= 0) {
@@ -376,12 +412,11 @@ void choose_width_height(struct display* display, int32_t hint_width, int32_t hi
 }
 
 static void
-xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *,
+xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *xdg_toplevel,
                               int32_t width, int32_t height,
                               struct wl_array *)
 {
-    struct window *window = (struct window *)data;
-    struct display *display = window->display;
+    struct display *display = (struct display *)data;
 
     if (width == 0 || height == 0) {
 		/* Compositor is deferring to us */
@@ -391,7 +426,7 @@ xdg_toplevel_handle_configure(void *data, struct xdg_toplevel *,
     if (!display->width || !display->height) {
         choose_width_height(display, width, height);
         if (!display->isMaximized)
-            xdg_toplevel_unset_maximized(window->xdg_toplevel);
+            xdg_toplevel_unset_maximized(xdg_toplevel);
     }
 }
 
@@ -399,27 +434,47 @@ static void
 send_key_event(display *data, uint32_t key, wl_keyboard_key_state state);
 
 static void
-xdg_toplevel_handle_close(void *data, struct xdg_toplevel *)
+xdg_toplevel_handle_close(void *data, struct xdg_toplevel *xdg_toplevel)
 {
-    struct window *window = (struct window *)data;
+    struct display *display = (struct display *)data;
+    std::shared_ptr<struct window> window;
+    std::string taskID;
+
+    // hwc_set may be destroying the window, only touch it through the
+    // registry so that it stays alive until we are done
+    auto windows = get_windows(display);
+    for (auto const& [surface, registered] : *windows) {
+        if (registered->xdg_toplevel == xdg_toplevel) {
+            window = registered;
+            break;
+        }
+    }
+    if (!window)
+        return;
+
+    {
+        std::scoped_lock lock(window->mutex);
+        if (!window->isActive || window->closed)
+            return;
+        // Unmapped and destroyed by the next hwc_set, on its own thread
+        window->closed = true;
+        taskID = window->taskID;
+    }
 
     // simulate user input to restart idle timeout (TODO: find a better way)
-    send_key_event(window->display, 0, WL_KEYBOARD_KEY_STATE_PRESSED);
-    send_key_event(window->display, 0, WL_KEYBOARD_KEY_STATE_RELEASED);
+    send_key_event(display, 0, WL_KEYBOARD_KEY_STATE_PRESSED);
+    send_key_event(display, 0, WL_KEYBOARD_KEY_STATE_RELEASED);
 
-    if (window->display->task != nullptr) {
-        if (window->taskID != "none") {
-            if (window->taskID == "0") {
+    if (display->task_state != TASK_SERVICE_MISSING) {
+        if (taskID != "none") {
+            if (taskID == "0") {
                 property_set("waydroid.active_apps", "none");
-                window->display->task->removeAllVisibleRecentTasks();
+                queue_task_removal(display, TASK_ID_ALL);
             } else {
-                window->display->task->removeTask(stoi(window->taskID));
+                queue_task_removal(display, stoi(taskID));
             }
         }
     }
-
-    std::scoped_lock lock(window->display->windowsMutex);
-    destroy_window(window, true);
 }
 
 static const struct xdg_toplevel_listener xdg_toplevel_listener = {
@@ -460,18 +515,189 @@ struct wl_shell_surface_listener shell_surface_listener = {
 	&shell_surface_popup_done
 };
 
+int64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Writes out buffered requests, waiting at most timeout_ms for the
+ * compositor to drain the socket. Returns -EAGAIN if requests are still
+ * buffered in libwayland when the deadline passes.
+ */
+int
+flush_display(struct display *display, int timeout_ms)
+{
+    struct pollfd pfd = { .fd = wl_display_get_fd(display->display), .events = POLLOUT };
+    int64_t deadline = monotonic_ns() + timeout_ms * 1000000LL;
+
+    while (wl_display_flush(display->display) == -1) {
+        if (errno != EAGAIN)
+            return -errno;
+
+        int64_t remaining = deadline - monotonic_ns();
+        if (remaining <= 0)
+            return -EAGAIN;
+        int ret = poll(&pfd, 1, (remaining + 999999) / 1000000);
+        if (ret == 0)
+            return -EAGAIN;
+        if (ret < 0 && errno != EINTR)
+            return -errno;
+    }
+    return 0;
+}
+
+statsLock::statsLock(std::mutex &mutex, struct lockStats &stats)
+    : mMutex(mutex), mStats(stats)
+{
+    if (!mMutex.try_lock()) {
+        mStats.contended++;
+        mMutex.lock();
+    }
+    mLockedAt = monotonic_ns();
+}
+
+statsLock::~statsLock()
+{
+    uint64_t held = monotonic_ns() - mLockedAt;
+    mStats.acquired++;
+    mStats.held_ns += held;
+    uint64_t max = mStats.max_held_ns;
+    while (held > max && !mStats.max_held_ns.compare_exchange_weak(max, held))
+        ;
+    mMutex.unlock();
+}
+
+std::shared_ptr<const windowList>
+get_windows(struct display *display)
+{
+    return std::atomic_load_explicit(&display->windows, std::memory_order_acquire);
+}
+
+// Structural changes copy the registry and publish the copy
+static void
+publish_windows(struct display *display, std::shared_ptr<const windowList> windows)
+{
+    std::atomic_store_explicit(&display->windows, std::move(windows), std::memory_order_release);
+}
+
+static void
+register_window(struct display *display, std::shared_ptr<struct window> window)
+{
+    statsLock lock(display->windowsMutex, display->windowsLockStats);
+    auto windows = std::make_shared<windowList>(*get_windows(display));
+    (*windows)[window->surface] = window;
+    publish_windows(display, windows);
+}
+
+static void
+unregister_window(struct display *display, struct wl_surface *surface)
+{
+    statsLock lock(display->windowsMutex, display->windowsLockStats);
+    auto windows = std::make_shared<windowList>(*get_windows(display));
+    windows->erase(surface);
+    publish_windows(display, windows);
+}
+
+// A wl_subsurface is bound to its parent, so only the wl_surface and its
+// viewport can be reused. The surface loses its role with the subsurface
+// and may be given a new one.
+static void
+release_layer_surface(struct window *window, size_t l, int64_t now)
+{
+    struct display *display = window->display;
+
+    wl_subsurface_destroy(window->subsurfaces[l]);
+    wl_surface_attach(window->surfaces[l], NULL, 0, 0);
+    wl_surface_commit(window->surfaces[l]);
+
+    if (display->surface_pool_count < SURFACE_POOL_MAX) {
+        display->surface_pool[display->surface_pool_count++] = {
+            .surface = window->surfaces[l],
+            .viewport = window->viewports[l],
+            .releasedAt = now
+        };
+    } else {
+        if (window->viewports[l])
+            wp_viewport_destroy(window->viewports[l]);
+        wl_surface_destroy(window->surfaces[l]);
+    }
+    window->surfaces[l] = NULL;
+    window->subsurfaces[l] = NULL;
+    window->viewports[l] = NULL;
+}
+
+// Appends a per-layer subsurface, reusing a pooled surface if there is one
+void
+add_layer_surface(struct window *window, int64_t now)
+{
+    struct display *display = window->display;
+    size_t l = window->surfaceCount;
+
+    if (display->surface_pool_count) {
+        // Most recently released first, the oldest ones are trimmed
+        struct pooledSurface *pooled = &display->surface_pool[--display->surface_pool_count];
+        window->surfaces[l] = pooled->surface;
+        window->viewports[l] = pooled->viewport;
+    } else {
+        window->surfaces[l] = wl_compositor_create_surface(display->compositor);
+        window->viewports[l] = display->viewporter ?
+                wp_viewporter_get_viewport(display->viewporter, window->surfaces[l]) : NULL;
+    }
+    window->subsurfaces[l] = wl_subcompositor_get_subsurface(display->subcompositor,
+                                                             window->surfaces[l],
+                                                             window->surface);
+    window->surfaceStates[l] = {};
+    window->surfaceUsedAt[l] = now;
+    window->surfaceCount++;
+}
+
+// Releases trailing per-layer surfaces that were not used since now - surface_idle_ns
+void
+trim_layer_surfaces(struct window *window, int64_t now)
+{
+    int64_t idle = window->display->surface_idle_ns;
+    while (window->surfaceCount &&
+           now - window->surfaceUsedAt[window->surfaceCount - 1] > idle) {
+        window->surfaceCount--;
+        release_layer_surface(window, window->surfaceCount, now);
+    }
+}
+
+void
+trim_surface_pool(struct display *display, int64_t now)
+{
+    size_t kept = 0;
+    for (size_t i = 0; i < display->surface_pool_count; i++) {
+        struct pooledSurface *pooled = &display->surface_pool[i];
+        if (now - pooled->releasedAt > display->surface_idle_ns) {
+            if (pooled->viewport)
+                wp_viewport_destroy(pooled->viewport);
+            wl_surface_destroy(pooled->surface);
+        } else {
+            display->surface_pool[kept++] = *pooled;
+        }
+    }
+    display->surface_pool_count = kept;
+}
+
+// Window memory is freed once hwc_set and every registry snapshot let go of it
 void
-destroy_window(struct window *window, bool keep)
+destroy_window(struct window *window)
 {
+    std::scoped_lock lock(window->mutex);
     if (window->isActive) {
         if (window->callback)
             wl_callback_destroy(window->callback);
 
-        for (auto it = window->surfaces.begin(); it != window->surfaces.end(); it++) {
-            if (window->viewports[it->first])
-                wp_viewport_destroy(window->viewports[it->first]);
-            wl_subsurface_destroy(window->subsurfaces[it->first]);
-            wl_surface_destroy(it->second);
+        // Per-layer surfaces go back to the pool
+        int64_t now = monotonic_ns();
+        while (window->surfaceCount) {
+            window->surfaceCount--;
+            release_layer_surface(window, window->surfaceCount, now);
         }
         if (window->xdg_toplevel)
             xdg_toplevel_destroy(window->xdg_toplevel);
@@ -485,20 +711,14 @@ destroy_window(struct window *window, bool keep)
             wl_subsurface_destroy(window->bg_subsurface);
         if (window->bg_surface)
             wl_surface_destroy(window->bg_surface);
-        if (window->bg_buffer)
-            wl_buffer_destroy(window->bg_buffer);
         if (window->viewport)
             wp_viewport_destroy(window->viewport);
 
+        unregister_window(window->display, window->surface);
         wl_surface_destroy(window->surface);
         wl_display_flush(window->display->display);
-
-        window->display->windows.erase(window->surface);
     }
-    if (keep)
-        window->isActive = false;
-    else
-        delete window;
+    window->isActive = false;
 }
 
 static void fractional_scale_handle_preferred_scale(void *data, struct wp_fractional_scale_v1 *,
@@ -516,46 +736,345 @@ static const struct wp_fractional_scale_v1_listener fractional_scale_listener =
     .preferred_scale = fractional_scale_handle_preferred_scale
 };
 
-struct window *
-create_window(struct display *display, bool use_subsurfaces, std::string appID, std::string taskID, hwc_color_t color)
+static void
+set_window_title(struct window *window, const char *title)
+{
+    if (window->xdg_toplevel)
+        xdg_toplevel_set_title(window->xdg_toplevel, title);
+    else if (window->shell_surface)
+        wl_shell_surface_set_title(window->shell_surface, title);
+}
+
+// Runs on the window worker, the HIDL call may take a while.
+// Resolves every app queued since the last run with a single call.
+static void
+resolve_window_titles(struct display *display)
+{
+    // Names stay pending, task_dispatch_loop queues this again once ready
+    if (display->task_state != TASK_SERVICE_READY)
+        return;
+
+    std::vector<std::string> appIDs;
+    {
+        std::scoped_lock lock(display->window_work_mutex);
+        appIDs.assign(display->pending_app_names.begin(), display->pending_app_names.end());
+        display->pending_app_names.clear();
+    }
+    if (appIDs.empty())
+        return;
+
+    std::vector<std::string> appNames = appIDs;
+    if (display->task_1_1) {
+        std::vector<hidl_string> packages(appIDs.begin(), appIDs.end());
+        display->task_1_1->getAppNames(packages, [&](const hidl_vec<hidl_string> &names) {
+            for (size_t i = 0; i < names.size() && i < appNames.size(); i++)
+                appNames[i] = names[i];
+        });
+    } else {
+        for (size_t i = 0; i < appIDs.size(); i++)
+            display->task->getAppName(hidl_string(appIDs[i]), [&](const hidl_string &value)
+                                      { appNames[i] = value; });
+    }
+    {
+        std::scoped_lock lock(display->window_work_mutex);
+        for (size_t i = 0; i < appIDs.size(); i++)
+            display->app_names[appIDs[i]] = appNames[i];
+    }
+
+    auto windows = get_windows(display);
+    for (auto const& [surface, window] : *windows) {
+        std::scoped_lock lock(window->mutex);
+        if (!window->isActive)
+            continue;
+        for (size_t i = 0; i < appIDs.size(); i++) {
+            if (window->appID == appIDs[i])
+                set_window_title(window, appNames[i].c_str());
+        }
+    }
+    wl_display_flush(display->display);
+}
+
+static struct wl_buffer *
+get_bg_buffer(struct display *display, hwc_color_t color)
+{
+    uint32_t argb = color.a << 24 | color.r << 16 | color.g << 8 | color.b;
+    auto it = display->bg_buffers.find(argb);
+    if (it != display->bg_buffers.end())
+        return it->second;
+
+    int fd = syscall(SYS_memfd_create, "buffer", 0);
+    ftruncate(fd, 4);
+    void *shm_data = mmap(NULL, 4, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (shm_data == MAP_FAILED) {
+        ALOGE("mmap failed");
+        close(fd);
+        exit(1);
+    }
+    *(uint32_t*)shm_data = argb;
+    munmap(shm_data, 4);
+
+    struct wl_shm_pool *pool = wl_shm_create_pool(display->shm, fd, 4);
+    struct wl_buffer *buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, 4, WL_SHM_FORMAT_ARGB8888);
+    wl_shm_pool_destroy(pool);
+    close(fd);
+
+    // 1x1 buffers are shared by every window with the same background
+    display->bg_buffers[argb] = buffer;
+    return buffer;
+}
+
+// Creates the surfaces of a window that do not depend on its role
+static struct window *
+alloc_window_surfaces(struct display *display, bool use_subsurfaces)
 {
     struct window *window = new struct window();
-    if (!window)
-        return NULL;
 
-    window->callback = NULL;
     window->display = display;
     window->surface = wl_compositor_create_surface(display->compositor);
+
+    // No subsurface background for us!
+    if (!use_subsurfaces && !display->subcompositor)
+        return window;
+
+    window->has_background = true;
+    struct wl_surface *surface = window->surface;
+    if (!use_subsurfaces) {
+        surface = wl_compositor_create_surface(display->compositor);
+        struct wl_subsurface *subsurface = wl_subcompositor_get_subsurface(display->subcompositor, surface, window->surface);
+        wl_subsurface_place_below(subsurface, window->surface);
+        window->bg_surface = surface;
+        window->bg_subsurface = subsurface;
+    }
+
+    if (display->viewporter) {
+        window->bg_viewport = wp_viewporter_get_viewport(display->viewporter, surface);
+        wp_viewport_set_source(window->bg_viewport, wl_fixed_from_int(0), wl_fixed_from_int(0), wl_fixed_from_int(1), wl_fixed_from_int(1));
+    }
+
+    return window;
+}
+
+static void
+fill_window_pool(struct display *display)
+{
+    std::scoped_lock lock(display->window_work_mutex);
+    while (display->window_pool.size() < display->window_pool_size)
+        display->window_pool.push_back(alloc_window_surfaces(display, display->window_pool_subsurfaces));
+    wl_display_flush(display->display);
+}
+
+void
+queue_window_work(struct display *display, std::function<void()> work)
+{
+    std::scoped_lock lock(display->window_work_mutex);
+    display->window_work_queue.push_back(work);
+    display->window_work_cond.notify_one();
+}
+
+void
+prewarm_windows(struct display *display, bool use_subsurfaces, size_t count)
+{
+    {
+        std::scoped_lock lock(display->window_work_mutex);
+        display->window_pool_size = count;
+        display->window_pool_subsurfaces = use_subsurfaces;
+    }
+    if (count)
+        queue_window_work(display, std::bind(fill_window_pool, display));
+}
+
+void* window_worker_loop(void* data) {
+    struct display* display = (struct display*) data;
+
+    while (true) {
+        std::function<void()> work;
+        {
+            std::unique_lock lock(display->window_work_mutex);
+            display->window_work_cond.wait(lock, [display] { return !display->window_work_queue.empty(); });
+            work = display->window_work_queue.front();
+            display->window_work_queue.pop_front();
+        }
+        // Work items talk to the compositor, so they wait out reconnects
+        std::unique_lock lock(display->connection_mutex);
+        display->connection_cond.wait(lock, [display] {
+            return display->connection_state == WAYLAND_CONNECTED;
+        });
+        work();
+    }
+    return NULL;
+}
+
+void
+queue_task_focus(struct display *display, int32_t taskID)
+{
+    std::scoped_lock lock(display->task_mutex);
+    // Only the latest focus change matters
+    display->pending_focus_task = taskID;
+    display->task_cond.notify_one();
+}
+
+void
+queue_task_removal(struct display *display, int32_t taskID)
+{
+    std::scoped_lock lock(display->task_mutex);
+    if (taskID == TASK_ID_ALL || display->pending_focus_task == taskID)
+        display->pending_focus_task = TASK_ID_NONE;
+    display->pending_task_removals.push_back(taskID);
+    display->task_cond.notify_one();
+}
+
+// Talks to the task service so that the Wayland thread never waits on binder
+void* task_dispatch_loop(void* data) {
+    struct display* display = (struct display*) data;
+
+    // Looked up here rather than in hwc_open, getService() blocks until the
+    // service is up and doesn't need to hold back the first frame
+    ATRACE_BEGIN("IWaydroidTask::getService");
+    display->task = IWaydroidTask::getService();
+    if (display->task)
+        display->task_1_1 = ::vendor::waydroid::task::V1_1::IWaydroidTask::castFrom(display->task);
+    ATRACE_END();
+    if (!display->task) {
+        ALOGE("No task service, window focus and titles won't follow Android");
+        display->task_state = TASK_SERVICE_MISSING;
+        return NULL;
+    }
+    display->task_state = TASK_SERVICE_READY;
+
+    // Titles of windows created meanwhile are still waiting
+    {
+        std::scoped_lock lock(display->window_work_mutex);
+        if (!display->pending_app_names.empty())
+            display->window_work_queue.push_back(std::bind(resolve_window_titles, display));
+        display->window_work_cond.notify_one();
+    }
+
+    while (true) {
+        int32_t focus;
+        std::list<int32_t> removals;
+        {
+            std::unique_lock lock(display->task_mutex);
+            display->task_cond.wait(lock, [display] {
+                return display->pending_focus_task != TASK_ID_NONE || !display->pending_task_removals.empty();
+            });
+            focus = display->pending_focus_task;
+            display->pending_focus_task = TASK_ID_NONE;
+            removals.swap(display->pending_task_removals);
+        }
+
+        if (focus != TASK_ID_NONE) {
+            if (display->task_1_1)
+                display->task_1_1->setFocusedTaskAsync(focus);
+            else
+                display->task->setFocusedTask(focus);
+        }
+        for (int32_t taskID : removals) {
+            if (taskID == TASK_ID_ALL) {
+                if (display->task_1_1)
+                    display->task_1_1->removeAllVisibleRecentTasksAsync();
+                else
+                    display->task->removeAllVisibleRecentTasks();
+            } else {
+                if (display->task_1_1)
+                    display->task_1_1->removeTaskAsync(taskID);
+                else
+                    display->task->removeTask(taskID);
+            }
+        }
+    }
+    return NULL;
+}
+
+void
+setup_window_background(struct window *window)
+{
+    struct display *display = window->display;
+
+    window->bg_ready = true;
+    if (!window->has_background)
+        return;
+
+    struct wl_surface *surface = window->bg_surface ? window->bg_surface : window->surface;
+    window->bg_buffer = get_bg_buffer(display, window->bg_color);
+    wl_surface_attach(surface, window->bg_buffer, 0, 0);
+    wl_surface_damage_buffer(surface, 0, 0, 1, 1);
+    if (surface == window->surface)
+        window->mainState.buffer = NULL;
+
+    if (window->bg_viewport)
+        wp_viewport_set_destination(window->bg_viewport, display->width, display->height);
+
+    if (display->wm_base)
+        xdg_surface_set_window_geometry(window->xdg_surface, 0, 0, display->width, display->height);
+
+    struct wl_region *region = wl_compositor_create_region(display->compositor);
+    if (window->bg_color.a == 0) {
+        wl_surface_set_input_region(surface, region);
+    }
+    if (window->bg_color.a == 255) {
+        wl_region_add(region, 0, 0, display->width, display->height);
+        wl_surface_set_opaque_region(surface, region);
+    }
+    wl_region_destroy(region);
+
+    wl_surface_commit(surface);
+    window->parentDirty = true;
+}
+
+std::shared_ptr<struct window>
+create_window(struct display *display, bool use_subsurfaces, std::string appID, std::string taskID, hwc_color_t color)
+{
+    std::shared_ptr<struct window> window;
+    {
+        std::scoped_lock lock(display->window_work_mutex);
+        if (!display->window_pool.empty() && display->window_pool_subsurfaces == use_subsurfaces) {
+            window.reset(display->window_pool.front());
+            display->window_pool.pop_front();
+        }
+    }
+    if (window)
+        queue_window_work(display, std::bind(fill_window_pool, display));
+    else
+        window.reset(alloc_window_surfaces(display, use_subsurfaces));
+    if (!window)
+        return nullptr;
+
     window->appID = appID;
     window->taskID = taskID;
     window->isActive = true;
-    window->bg_viewport = NULL;
-    window->bg_buffer = NULL;
-    window->bg_surface = NULL;
-    window->bg_subsurface = NULL;
+    window->bg_color = color;
 
     bool calibrating = !display->height || !display->width;
 
+    std::string appName;
+    bool resolveName = false;
+    if (appID != "Waydroid" && display->task_state != TASK_SERVICE_MISSING) {
+        std::scoped_lock lock(display->window_work_mutex);
+        auto it = display->app_names.find(appID);
+        if (it != display->app_names.end())
+            appName = it->second;
+        else
+            resolveName = display->pending_app_names.insert(appID).second &&
+                          display->pending_app_names.size() == 1;
+    } else {
+        appName = appID;
+    }
+
     if (display->wm_base) {
         window->xdg_surface =
                 xdg_wm_base_get_xdg_surface(display->wm_base, window->surface);
         assert(window->xdg_surface);
         
         xdg_surface_add_listener(window->xdg_surface,
-                                     &xdg_surface_listener, window);
+                                     &xdg_surface_listener, window.get());
 
         window->xdg_toplevel = xdg_surface_get_toplevel(window->xdg_surface);
         assert(window->xdg_toplevel);
-        xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener, window);
+        xdg_toplevel_add_listener(window->xdg_toplevel, &xdg_toplevel_listener, display);
         if (display->isMaximized || !display->height || !display->width)
             xdg_toplevel_set_maximized(window->xdg_toplevel);
-        const hidl_string appID_hidl(appID);
-        hidl_string appName_hidl(appID);
-        if (appID != "Waydroid" && display->task)
-            display->task->getAppName(appID_hidl, [&](const hidl_string &value)
-                                      { xdg_toplevel_set_title(window->xdg_toplevel, value.c_str()); });
-        else
-            xdg_toplevel_set_title(window->xdg_toplevel, appID.c_str());
+        if (!appName.empty())
+            xdg_toplevel_set_title(window->xdg_toplevel, appName.c_str());
 
         if (appID != "Waydroid")
             appID = "waydroid." + appID;
@@ -565,98 +1084,69 @@ create_window(struct display *display, bool use_subsurfaces, std::string appID,
             wl_shell_get_shell_surface(display->shell, window->surface);
         assert(window->shell_surface);
 
-        wl_shell_surface_add_listener(window->shell_surface, &shell_surface_listener, window);
+        wl_shell_surface_add_listener(window->shell_surface, &shell_surface_listener, window.get());
         wl_shell_surface_set_toplevel(window->shell_surface);
         if (display->isMaximized || !display->height || !display->width)
             wl_shell_surface_set_maximized(window->shell_surface, display->output);
-        const hidl_string appID_hidl(appID);
-        hidl_string appName_hidl(appID);
-        if (appID != "Waydroid" && display->task)
-            display->task->getAppName(appID_hidl, [&](const hidl_string &value)
-                                      { wl_shell_surface_set_title(window->shell_surface, value.c_str()); });
-        else
-            wl_shell_surface_set_title(window->shell_surface, appID.c_str());
+        if (!appName.empty())
+            wl_shell_surface_set_title(window->shell_surface, appName.c_str());
+        // wl_shell has no configure handshake to wait for
+        window->configured = true;
     } else {
         assert(0);
     }
 
-    if (calibrating && display->fractional_scale_manager) {
+    register_window(display, window);
+    if (resolveName)
+        queue_window_work(display, std::bind(resolve_window_titles, display));
+
+    // The initial commit without a buffer asks for the first configure
+    if (!calibrating) {
+        wl_surface_commit(window->surface);
+        if (display->globals_pending) {
+            // Only the first window after connecting, before the Wayland thread runs
+            wl_display_roundtrip(display->display);
+            display->globals_pending = false;
+        }
+        if (!display->scale_published)
+            finished_computing_scale(display);
+        if (window->configured)
+            setup_window_background(window.get());
+        wl_display_flush(display->display);
+        return window;
+    }
+
+    // We don't know the window size yet, so block until the compositor tells us.
+    // This only happens from hwc_open and after reconnecting.
+    wp_fractional_scale_v1* fs = NULL;
+    if (display->fractional_scale_manager) {
         // We only support one global scale
-        wp_fractional_scale_v1* fs = wp_fractional_scale_manager_v1_get_fractional_scale(
+        fs = wp_fractional_scale_manager_v1_get_fractional_scale(
                 display->fractional_scale_manager, window->surface);
         wp_fractional_scale_v1_add_listener(fs, &fractional_scale_listener, display);
-        wl_display_roundtrip(display->display);
-        wp_fractional_scale_v1_destroy(fs);
     }
-    finished_computing_scale(display);
 
     wl_surface_commit(window->surface);
 
     /* Here we retrieve objects if executed without immed, or error */
+    // Also brings the events of every global bound in connect_display
     wl_display_roundtrip(display->display);
-    wl_surface_commit(window->surface);
-
-    if (calibrating) {
-        // If we did not receive a window size from the compositor we have to fall back to using the whole output size
-        // At the time of writing this happens on wlroots compositors
-        if (!display->height)
-            display->height = display->full_height / display->scale;
-        if (!display->width)
-            display->width = display->full_width / display->scale;
-    }
-
-    // No subsurface background for us!
-    if (!use_subsurfaces && !display->subcompositor)
-        return window;
-
-    int fd = syscall(SYS_memfd_create, "buffer", 0);
-    ftruncate(fd, 4);
-    void *shm_data = mmap(NULL, 4, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (shm_data == MAP_FAILED) {
-        ALOGE("mmap failed");
-        close(fd);
-        exit(1);
-    }
-    uint32_t *buf = (uint32_t*)shm_data;
-    *buf = color.a << 24 | color.r << 16 | color.g << 8 | color.b;
-
-    struct wl_shm_pool *pool = wl_shm_create_pool(display->shm, fd, 4);
-    window->bg_buffer = wl_shm_pool_create_buffer(pool, 0, 1, 1, 4, WL_SHM_FORMAT_ARGB8888);
-    wl_shm_pool_destroy(pool);
-    close(fd);
-
-    struct wl_surface *surface = window->surface;
-    if (!use_subsurfaces) {
-        surface = wl_compositor_create_surface(display->compositor);
-        struct wl_subsurface *subsurface = wl_subcompositor_get_subsurface(display->subcompositor, surface, window->surface);
-        wl_subsurface_place_below(subsurface, window->surface);
-        window->bg_surface = surface;
-        window->bg_subsurface = subsurface;
-    }
-
-    wl_surface_attach(surface, window->bg_buffer, 0, 0);
-    wl_surface_damage_buffer(surface, 0, 0, 1, 1);
-
-    if (display->viewporter) {
-        window->bg_viewport = wp_viewporter_get_viewport(display->viewporter, surface);
-        wp_viewport_set_source(window->bg_viewport, wl_fixed_from_int(0), wl_fixed_from_int(0), wl_fixed_from_int(1), wl_fixed_from_int(1));
-        wp_viewport_set_destination(window->bg_viewport, display->width, display->height);
-    }
+    display->globals_pending = false;
+    if (fs)
+        wp_fractional_scale_v1_destroy(fs);
+    finished_computing_scale(display);
 
-    if (display->wm_base)
-        xdg_surface_set_window_geometry(window->xdg_surface, 0, 0, display->width, display->height);
+    wl_surface_commit(window->surface);
 
-    struct wl_region *region = wl_compositor_create_region(display->compositor);
-    if (color.a == 0) {
-        wl_surface_set_input_region(surface, region);
-    }
-    if (color.a == 255) {
-        wl_region_add(region, 0, 0, display->width, display->height);
-        wl_surface_set_opaque_region(surface, region);
-    }
-    wl_region_destroy(region);
+    // If we did not receive a window size from the compositor we have to fall back to using the whole output size
+    // At the time of writing this happens on wlroots compositors
+    if (!display->height)
+        display->height = display->full_height / display->scale;
+    if (!display->width)
+        display->width = display->full_width / display->scale;
 
-    wl_surface_commit(surface);
+    if (window->configured)
+        setup_window_background(window.get());
 
     return window;
 }
@@ -744,15 +1234,17 @@ keyboard_handle_enter(void *data, struct wl_keyboard *,
 {
     struct display *display = (struct display *)data;
 
-    std::scoped_lock lock(display->windowsMutex);
-    if (display->windows.find(surface) == display->windows.end())
+    auto windows = get_windows(display);
+    auto it = windows->find(surface);
+    if (it == windows->end())
         return;
 
-    struct window *window = display->windows[surface];
+    // The task ID never changes after creation, no need to lock the window
+    struct window *window = it->second.get();
 
-    if (window->display->task != nullptr) {
+    if (window->display->task_state != TASK_SERVICE_MISSING) {
         if (window->taskID != "none" && window->taskID != "0") {
-            window->display->task->setFocusedTask(stoi(window->taskID));
+            queue_task_focus(window->display, stoi(window->taskID));
         }
     }
 }
@@ -931,76 +1423,173 @@ pointer_handle_button(void *data, struct wl_pointer *,
 }
 
 static void
-pointer_handle_axis(void *data, struct wl_pointer *,
-                    uint32_t, uint32_t axis, wl_fixed_t value)
+pointer_flush_axis_frame(struct display *display)
 {
-    struct display* display = (struct display*)data;
-    struct input_event event[2];
+    struct input_event event[5];
     struct timespec rt;
-    unsigned int res, move, n = 0;
-    double fVal = wl_fixed_to_double(value) / 10.0f;
-    double step = 1.0f;
+    unsigned int res, n = 0;
 
-    if (ensure_pipe(display, INPUT_POINTER))
-        return;
+    if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
+        ALOGE("%s:%d error in touch clock_gettime: %s",
+              __FILE__, __LINE__, strerror(errno));
+    }
 
-    if (!display->pointer_surface)
-        return;
+    for (int axis = WL_POINTER_AXIS_VERTICAL_SCROLL; axis <= WL_POINTER_AXIS_HORIZONTAL_SCROLL; axis++) {
+        struct axisFrame *frame = &display->axisFrames[axis];
+        if (!frame->pending) {
+            *frame = {};
+            continue;
+        }
 
-    if (!display->reverseScroll) {
-        fVal = -fVal;
-    }
+        // Wayland and evdev disagree on the sign of both axes
+        double sign = (display->reverseScroll && !frame->inverted) ? 1.0 : -1.0;
+        double hires;
+        if (frame->value120)
+            hires = frame->value120;
+        else if (frame->discrete)
+            hires = frame->discrete * AXIS_VALUE120_NOTCH;
+        else
+            // 10 surface units per notch, as libinput does for wheel emulation
+            hires = frame->value * AXIS_VALUE120_NOTCH / 10.0;
+
+        display->wheelHiResAccumulator[axis] += sign * hires;
+        int32_t hiresMove = (int32_t)display->wheelHiResAccumulator[axis];
+        display->wheelHiResAccumulator[axis] -= hiresMove;
+        display->wheelAccumulator[axis] += hiresMove;
+
+        int32_t move = display->wheelAccumulator[axis] / AXIS_VALUE120_NOTCH;
+        display->wheelAccumulator[axis] -= move * AXIS_VALUE120_NOTCH;
+
+        if (display->wheelSource == WL_POINTER_AXIS_SOURCE_WHEEL && !frame->value120) {
+            // Low resolution wheels always move by whole notches
+            display->wheelAccumulator[axis] = 0;
+            display->wheelHiResAccumulator[axis] = 0;
+        } else if (frame->stop) {
+            // End of a kinetic scroll: round the leftover to the closest notch so a
+            // short swipe still scrolls apps that only understand REL_WHEEL, and
+            // start the next gesture from zero.
+            if (std::abs(display->wheelAccumulator[axis]) >= AXIS_VALUE120_NOTCH / 2)
+                move += display->wheelAccumulator[axis] > 0 ? 1 : -1;
+            display->wheelAccumulator[axis] = 0;
+            display->wheelHiResAccumulator[axis] = 0;
+        }
 
-    if (axis == WL_POINTER_AXIS_VERTICAL_SCROLL) {
-        display->wheelAccumulatorY += fVal;
-        if (std::abs(display->wheelAccumulatorY) < step)
-            return;
-        move = (int)(display->wheelAccumulatorY / step);
-        display->wheelAccumulatorY = display->wheelEvtIsDiscrete ? 0 :
-                                     std::fmod(display->wheelAccumulatorY, step);
-    } else {
-        display->wheelAccumulatorX += fVal;
-        if (std::abs(display->wheelAccumulatorX) < step)
-            return;
-        move = (int)(display->wheelAccumulatorX / step);
-        display->wheelAccumulatorX = display->wheelEvtIsDiscrete ? 0 :
-                                     std::fmod(display->wheelAccumulatorY, step);
-    }
+        if (hiresMove) {
+            ADD_EVENT(EV_REL, (axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
+                      ? REL_WHEEL_HI_RES : REL_HWHEEL_HI_RES, hiresMove);
+        }
+        if (move) {
+            ADD_EVENT(EV_REL, (axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
+                      ? REL_WHEEL : REL_HWHEEL, move);
+        }
 
-    if (clock_gettime(CLOCK_MONOTONIC, &rt) == -1) {
-        ALOGE("%s:%d error in touch clock_gettime: %s",
-              __FILE__, __LINE__, strerror(errno));
+        *frame = {};
     }
 
-    ADD_EVENT(EV_REL, (axis == WL_POINTER_AXIS_VERTICAL_SCROLL)
-              ? REL_WHEEL : REL_HWHEEL, move);
+    if (!n)
+        return;
+
     ADD_EVENT(EV_SYN, SYN_REPORT, 0);
 
-    res = write(display->input_fd[INPUT_POINTER], &event, sizeof(event));
-    if (res < sizeof(event))
+    res = write(display->input_fd[INPUT_POINTER], &event, n * sizeof(*event));
+    if (res < n * sizeof(*event))
         ALOGE("Failed to write event for InputFlinger: %s", strerror(errno));
 }
 
+// Returns true if the caller has to flush the frame itself
+static bool
+pointer_axis_queue(struct display *display, struct wl_pointer *pointer, uint32_t axis)
+{
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return false;
+
+    if (ensure_pipe(display, INPUT_POINTER))
+        return false;
+
+    if (!display->pointer_surface)
+        return false;
+
+    display->axisFrames[axis].pending = true;
+    // Compositors older than wl_pointer v5 never send a frame event
+    return wl_pointer_get_version(pointer) < WL_POINTER_FRAME_SINCE_VERSION;
+}
+
+static void
+pointer_handle_axis(void *data, struct wl_pointer *pointer,
+                    uint32_t, uint32_t axis, wl_fixed_t value)
+{
+    struct display* display = (struct display*)data;
+
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    display->axisFrames[axis].value += wl_fixed_to_double(value);
+    if (pointer_axis_queue(display, pointer, axis))
+        pointer_flush_axis_frame(display);
+}
+
 static void
 pointer_handle_axis_source(void *data, struct wl_pointer *, uint32_t source)
 {
     struct display* display = (struct display*)data;
-    display->wheelEvtIsDiscrete = (source == WL_POINTER_AXIS_SOURCE_WHEEL);
+    display->wheelSource = source;
+}
+
+static void
+pointer_handle_axis_stop(void *data, struct wl_pointer *pointer, uint32_t, uint32_t axis)
+{
+    struct display* display = (struct display*)data;
+
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    display->axisFrames[axis].stop = true;
+    if (pointer_axis_queue(display, pointer, axis))
+        pointer_flush_axis_frame(display);
 }
 
 static void
-pointer_handle_axis_stop(void *, struct wl_pointer *, uint32_t, uint32_t)
+pointer_handle_axis_discrete(void *data, struct wl_pointer *pointer, uint32_t axis, int32_t discrete)
 {
+    struct display* display = (struct display*)data;
+
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    display->axisFrames[axis].discrete += discrete;
+    if (pointer_axis_queue(display, pointer, axis))
+        pointer_flush_axis_frame(display);
+}
+
+#ifdef WL_POINTER_AXIS_VALUE120_SINCE_VERSION
+static void
+pointer_handle_axis_value120(void *data, struct wl_pointer *pointer, uint32_t axis, int32_t value120)
+{
+    struct display* display = (struct display*)data;
+
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    display->axisFrames[axis].value120 += value120;
+    if (pointer_axis_queue(display, pointer, axis))
+        pointer_flush_axis_frame(display);
 }
+#endif
 
+#ifdef WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION
 static void
-pointer_handle_axis_discrete(void *, struct wl_pointer *, uint32_t, int32_t)
+pointer_handle_axis_relative_direction(void *data, struct wl_pointer *, uint32_t axis, uint32_t direction)
 {
+    struct display* display = (struct display*)data;
+
+    if (axis > WL_POINTER_AXIS_HORIZONTAL_SCROLL)
+        return;
+    // The compositor already applied natural scrolling to this axis, so
+    // persist.waydroid.reverse_scrolling must not flip it back again
+    display->axisFrames[axis].inverted = (direction == WL_POINTER_AXIS_RELATIVE_DIRECTION_INVERTED);
 }
+#endif
 
 static void
-pointer_handle_frame(void *, struct wl_pointer *)
+pointer_handle_frame(void *data, struct wl_pointer *)
 {
+    pointer_flush_axis_frame((struct display*)data);
 }
 
 static const struct wl_pointer_listener pointer_listener = {
@@ -1013,6 +1602,12 @@ static const struct wl_pointer_listener pointer_listener = {
     pointer_handle_axis_source,
     pointer_handle_axis_stop,
     pointer_handle_axis_discrete,
+#ifdef WL_POINTER_AXIS_VALUE120_SINCE_VERSION
+    pointer_handle_axis_value120,
+#endif
+#ifdef WL_POINTER_AXIS_RELATIVE_DIRECTION_SINCE_VERSION
+    pointer_handle_axis_relative_direction,
+#endif
 };
 
 static int
@@ -1237,6 +1832,18 @@ static const struct wl_touch_listener touch_listener = {
     touch_handle_orientation,
 };
 
+/*
+ * Lifts every key and finger Android still sees as down, as if the seat
+ * had lost focus. The compositor never sends the matching release once
+ * the connection is gone.
+ */
+static void
+release_input(struct display *display)
+{
+    keyboard_handle_leave(display, NULL, 0, NULL);
+    touch_handle_cancel(display, NULL);
+}
+
 static void
 xdg_wm_base_ping(void *, struct xdg_wm_base *wm_base, uint32_t serial)
 {
@@ -1805,7 +2412,7 @@ registry_handle_global(void *data, struct wl_registry *registry,
                 registry, id, &wl_shell_interface, 1);
     } else if (strcmp(interface, "wl_seat") == 0) {
         d->seat = (struct wl_seat*)wl_registry_bind(registry, id,
-                &wl_seat_interface, std::min(version, (uint32_t)WL_POINTER_AXIS_SOURCE_SINCE_VERSION));
+                &wl_seat_interface, std::min(version, WL_SEAT_MAX_VERSION));
         wl_seat_add_listener(d->seat, &seat_listener, d);
         if (d->tablet_manager && !d->tablet_seat)
             add_tablet_seat(d);
@@ -1815,8 +2422,8 @@ registry_handle_global(void *data, struct wl_registry *registry,
     } else if (strcmp(interface, "wl_output") == 0) {
         d->output = (struct wl_output*)wl_registry_bind(registry, id,
                 &wl_output_interface, std::min(version, 3U));
+        // Mode and scale arrive with the next roundtrip, see globals_pending
         wl_output_add_listener(d->output, &output_listener, d);
-        wl_display_roundtrip(d->display);
     } else if (strcmp(interface, "wp_presentation") == 0) {
         bool no_presentation = property_get_bool("persist.waydroid.no_presentation", false);
         if (!no_presentation) {
@@ -1889,6 +2496,22 @@ wayland_log_handler (const char *format, va_list args)
     LOG_PRI_VA (ANDROID_LOG_ERROR, "wayland-hwc", format, args);
 }
 
+// Connects and binds the globals, see registry_handle_global
+static bool
+connect_display(struct display *display)
+{
+    display->display = wl_display_connect(NULL);
+    if (!display->display)
+        return false;
+
+    display->registry = wl_display_get_registry(display->display);
+    wl_registry_add_listener(display->registry,
+                 &registry_listener, display);
+    wl_display_roundtrip(display->display);
+    display->globals_pending = true;
+    return true;
+}
+
 struct display *
 create_display(const char *gralloc)
 {
@@ -1901,31 +2524,39 @@ create_display(const char *gralloc)
     display->gtype = get_gralloc_type(gralloc);
     display->refresh = 0;
     display->isMaximized = true;
-    display->display = wl_display_connect(NULL);
+    display->pending_focus_task = TASK_ID_NONE;
+    publish_windows(display, std::make_shared<const windowList>());
     ALOGI("WAYLAND_DISPLAY: %s", getenv("WAYLAND_DISPLAY"));
     ALOGI("XDG_RUNTIME_DIR: %s", getenv("XDG_RUNTIME_DIR"));
-    if (!display->display) {
-        ALOGE("Couldn't open Wayland display.");
-        return NULL;
-    }
     sem_init(&display->egl_go, 0, 0);
     sem_init(&display->egl_done, 0, 0);
 
     umask(0);
     mkdir("/dev/input", S_IRWXO | S_IRWXG | S_IRWXU);
     chown("/dev/input", 1000, 1000);
-    display->registry = wl_display_get_registry(display->display);
-    wl_registry_add_listener(display->registry,
-                 &registry_listener, display);
-    wl_display_roundtrip(display->display);
+    if (!connect_display(display)) {
+        ALOGE("Couldn't open Wayland display.");
+        return NULL;
+    }
+
+    display->layer_metadata_queue.reset(new LayerMetadataQueue(LAYER_METADATA_QUEUE_SIZE, false /* configureEventFlagWord */));
+    if (display->layer_metadata_queue->isValid()) {
+        display->layer_metadata.resize(LAYER_METADATA_QUEUE_SIZE);
+    } else {
+        ALOGE("Failed to create layer metadata queue");
+        display->layer_metadata_queue.reset();
+    }
 
-    display->task = IWaydroidTask::getService();
     return display;
 }
 
-void
-destroy_display(struct display *display)
+// Destroys the globals and closes the connection, the display itself stays
+static void
+disconnect_display(struct display *display)
 {
+    if (!display->display)
+        return;
+
     if (display->wm_base)
         xdg_wm_base_destroy(display->wm_base);
 
@@ -1949,8 +2580,154 @@ destroy_display(struct display *display)
     if (display->pointer_constraints)
         zwp_pointer_constraints_v1_destroy(display->pointer_constraints);
 
+    if (display->relative_pointer)
+        zwp_relative_pointer_v1_destroy(display->relative_pointer);
+
+    if (display->pointer)
+        wl_pointer_destroy(display->pointer);
+
+    if (display->keyboard)
+        wl_keyboard_destroy(display->keyboard);
+
+    if (display->touch)
+        wl_touch_destroy(display->touch);
+
+    if (display->seat)
+        wl_seat_destroy(display->seat);
+
+    if (display->output)
+        wl_output_destroy(display->output);
+
+    if (display->subcompositor)
+        wl_subcompositor_destroy(display->subcompositor);
+
+    if (display->shm)
+        wl_shm_destroy(display->shm);
+
+    if (display->presentation)
+        wp_presentation_destroy(display->presentation);
+
+    if (display->viewporter)
+        wp_viewporter_destroy(display->viewporter);
+
+    if (display->android_wlegl)
+        android_wlegl_destroy(display->android_wlegl);
+
+    if (display->dmabuf)
+        zwp_linux_dmabuf_v1_destroy(display->dmabuf);
+
+    if (display->idle_manager)
+        zwp_idle_inhibit_manager_v1_destroy(display->idle_manager);
+
+    if (display->fractional_scale_manager)
+        wp_fractional_scale_manager_v1_destroy(display->fractional_scale_manager);
+
     wl_registry_destroy(display->registry);
     wl_display_flush(display->display);
     wl_display_disconnect(display->display);
+    display->display = NULL;
+}
+
+/*
+ * Replaces a lost connection, only called from SurfaceFlinger's thread
+ * while the Wayland thread waits for WAYLAND_CONNECTED. Windows and
+ * buffers must have been destroyed by then. HAL state like the layer
+ * slots, registries and the task service is kept.
+ */
+bool
+reconnect_display(struct display *display)
+{
+    std::scoped_lock lock(display->connection_mutex);
+
+    if (display->display) {
+        {
+            std::scoped_lock workLock(display->window_work_mutex);
+            for (struct window *window : display->window_pool) {
+                if (window->bg_viewport)
+                    wp_viewport_destroy(window->bg_viewport);
+                if (window->bg_subsurface)
+                    wl_subsurface_destroy(window->bg_subsurface);
+                if (window->bg_surface)
+                    wl_surface_destroy(window->bg_surface);
+                wl_surface_destroy(window->surface);
+                delete window;
+            }
+            display->window_pool.clear();
+        }
+        for (size_t i = 0; i < display->surface_pool_count; i++) {
+            if (display->surface_pool[i].viewport)
+                wp_viewport_destroy(display->surface_pool[i].viewport);
+            wl_surface_destroy(display->surface_pool[i].surface);
+        }
+        display->surface_pool_count = 0;
+        for (auto const& [argb, buffer] : display->bg_buffers)
+            wl_buffer_destroy(buffer);
+        display->bg_buffers.clear();
+
+        display->had_cursor_surface = display->cursor_surface != NULL;
+        if (display->cursor_viewport)
+            wp_viewport_destroy(display->cursor_viewport);
+        if (display->cursor_surface)
+            wl_surface_destroy(display->cursor_surface);
+        display->cursor_viewport = NULL;
+        display->cursor_surface = NULL;
+
+        // Input focus refers to surfaces of the old connection
+        release_input(display);
+        display->pointer_surface = NULL;
+        display->tablet_surface = NULL;
+        display->touch_surfaces.clear();
+        display->layers.clear();
+        display->tablet_tools_evt.clear();
+
+        disconnect_display(display);
+        display->registry = NULL;
+        display->compositor = NULL;
+        display->subcompositor = NULL;
+        display->seat = NULL;
+        display->shell = NULL;
+        display->shm = NULL;
+        display->pointer = NULL;
+        display->keyboard = NULL;
+        display->touch = NULL;
+        display->output = NULL;
+        display->presentation = NULL;
+        display->viewporter = NULL;
+        display->android_wlegl = NULL;
+        display->dmabuf = NULL;
+        display->wm_base = NULL;
+        display->tablet_manager = NULL;
+        display->tablet_seat = NULL;
+        display->tablet_tools.clear();
+        display->pointer_constraints = NULL;
+        display->relative_pointer_manager = NULL;
+        display->relative_pointer = NULL;
+        display->idle_manager = NULL;
+        display->fractional_scale_manager = NULL;
+        free(display->formats);
+        display->formats = NULL;
+        display->formats_count = 0;
+        display->modifiers.clear();
+        // Output events only ever raise these
+        display->scale = 0;
+        display->refresh = 0;
+    }
+
+    if (!connect_display(display))
+        return false;
+
+    if (display->had_cursor_surface) {
+        display->cursor_surface = wl_compositor_create_surface(display->compositor);
+        if (display->viewporter)
+            display->cursor_viewport = wp_viewporter_get_viewport(display->viewporter, display->cursor_surface);
+    }
+    return true;
+}
+
+void
+destroy_display(struct display *display)
+{
+    release_input(display);
+    disconnect_display(display);
     delete display;
 }
@@ -43,13 +43,23 @@
 #include <getopt.h>
 #include <errno.h>
 #include <map>
+#include <memory>
 #include <list>
+#include <set>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
 #include <pthread.h>
 #include <semaphore.h>
 #include <hardware/hwcomposer.h>
+#include <fmq/MessageQueue.h>
+#include <vendor/waydroid/display/1.2/types.h>
 #include <vendor/waydroid/task/1.0/IWaydroidTask.h>
+#include <vendor/waydroid/task/1.1/IWaydroidTask.h>
 #include <wayland-util.h>
 
+#include "layer-slots.h"
+
 #define EGL_EGLEXT_PROTOTYPES
 #include <EGL/egl.h>
 #include <EGL/eglext.h>
@@ -58,6 +68,9 @@
 
 using ::android::sp;
 using ::vendor::waydroid::task::V1_0::IWaydroidTask;
+using ::vendor::waydroid::display::V1_2::LayerMetadata;
+
+typedef ::android::hardware::MessageQueue<LayerMetadata, ::android::hardware::kSynchronizedReadWrite> LayerMetadataQueue;
 
 enum {
     INPUT_TOUCH,
@@ -83,22 +96,94 @@ enum {
 
 #define MAX_TOUCHPOINTS 10
 
+// Enough for a few frames of a busy scene
+#define LAYER_METADATA_QUEUE_SIZE 512
+
+// Special task IDs for the task dispatcher
+#define TASK_ID_NONE -1
+#define TASK_ID_ALL -2
+
+// One wl_pointer.axis notch, as used by axis_value120 and REL_WHEEL_HI_RES
+#define AXIS_VALUE120_NOTCH 120
+
+struct axisFrame {
+    double value;      // continuous axis value in surface units
+    int32_t value120;  // high-resolution wheel value, 120 per notch
+    int32_t discrete;  // legacy notch count, pre-v8 compositors only
+    bool stop;
+    bool inverted;     // axis_relative_direction reported natural scrolling
+    bool pending;
+};
+
 struct layerFrame {
     int x;
     int y;
 };
 
-struct handleExt {
-    uint32_t format;
-    uint32_t stride;
-    uint32_t width;
-    uint32_t height;
+/*
+ * Last state committed to a surface, to skip unchanged requests.
+ * valid covers the viewport and position, a NULL buffer means the
+ * transform and scale are unknown too.
+ */
+struct surfaceState {
+    bool valid;
+    wl_fixed_t srcX, srcY, srcWidth, srcHeight;
+    int32_t dstWidth, dstHeight;
+    int32_t x, y;
+    int32_t transform;
+    int32_t scale;
+    struct wl_buffer *buffer;
+};
+
+// A released per-layer surface, kept for the next window that needs one
+struct pooledSurface {
+    struct wl_surface *surface;
+    struct wp_viewport *viewport;
+    int64_t releasedAt;
 };
 
+#define SURFACE_POOL_MAX 32
+
+// display->task_state, see task_dispatch_loop
+#define TASK_SERVICE_PENDING 0
+#define TASK_SERVICE_READY 1
+#define TASK_SERVICE_MISSING 2
+
+// display->connection_state, see reconnect_display
+#define WAYLAND_CONNECTED 0
+#define WAYLAND_DISCONNECTED 1
+
 struct window;
 
+typedef std::map<struct wl_surface *, std::shared_ptr<struct window>> windowList;
+
+// Hold time and contention of a mutex taken through statsLock
+struct lockStats {
+    std::atomic<uint64_t> acquired;
+    std::atomic<uint64_t> contended;
+    std::atomic<uint64_t> held_ns;
+    std::atomic<uint64_t> max_held_ns;
+};
+
+class statsLock {
+  public:
+    statsLock(std::mutex &mutex, struct lockStats &stats);
+    ~statsLock();
+  private:
+    std::mutex &mMutex;
+    struct lockStats &mStats;
+    int64_t mLockedAt;
+};
+
 struct display {
     struct wl_display *display;
+    // Set by the Wayland thread when the compositor goes away, the window
+    // worker waits on connection_cond and holds connection_mutex for its work.
+    // reconnect_display replaces the globals below under connection_mutex, so
+    // other threads using them hold it too.
+    std::atomic<int> connection_state;
+    std::mutex connection_mutex;
+    std::condition_variable connection_cond;
     struct wl_registry *registry;
     struct wl_compositor *compositor;
     struct wl_subcompositor *subcompositor;
@@ -127,18 +212,26 @@ struct display {
     int input_fd[INPUT_TOTAL];
     int ptrPrvX;
     int ptrPrvY;
-    double wheelAccumulatorX;
-    double wheelAccumulatorY;
-    bool wheelEvtIsDiscrete;
+    // Indexed by wl_pointer_axis, accumulated until wl_pointer.frame
+    struct axisFrame axisFrames[2];
+    // Sub-unit REL_WHEEL_HI_RES remainder and sub-notch REL_WHEEL remainder
+    double wheelHiResAccumulator[2];
+    int32_t wheelAccumulator[2];
+    uint32_t wheelSource;
     bool reverseScroll;
     int touch_id[MAX_TOUCHPOINTS];
     std::map<struct wl_surface *, struct layerFrame> layers;
-    std::map<struct wl_surface *, struct window *> windows;
+    // Immutable snapshot of the registered windows, replaced on every
+    // structural change. Writers hold windowsMutex, readers use get_windows(),
+    // the pointer itself is only accessed through std::atomic_load/store.
+    std::shared_ptr<const windowList> windows;
     std::mutex windowsMutex;
+    struct lockStats windowsLockStats;
     std::map<int, struct wl_surface *> touch_surfaces;
     struct wl_surface *pointer_surface;
     struct wl_surface *cursor_surface;
     struct wp_viewport *cursor_viewport;
+    bool had_cursor_surface;
     struct wl_surface *tablet_surface;
     std::list<struct zwp_tablet_tool_v2 *> tablet_tools;
     std::map<struct zwp_tablet_tool_v2 *, uint16_t> tablet_tools_evt;
@@ -157,14 +250,52 @@ struct display {
     int formats_count;
     std::map<uint32_t, std::vector<uint64_t>> modifiers;
     bool geo_changed;
-    std::map<uint32_t, std::string> layer_names;
-    std::map<uint32_t, struct handleExt> layer_handles_ext;
-    struct handleExt target_layer_handle_ext;
+    struct layerSlotTable layer_slots;
+    // Set once SurfaceFlinger sends layer tasks instead of encoding them in layer names
+    std::atomic<bool> layer_tasks_pushed;
+    // Registered over display@1.2, protected by registry_mutex
+    std::map<uint32_t, std::string> app_registry;
+    std::map<uint32_t, std::string> layer_name_registry;
+    std::mutex registry_mutex;
+    // Whole layer table written once per frame by SurfaceFlinger, drained in hwc_set
+    std::unique_ptr<LayerMetadataQueue> layer_metadata_queue;
+    std::vector<LayerMetadata> layer_metadata;
+    uint32_t layer_metadata_seq;
     std::map<buffer_handle_t, struct buffer *> buffer_map;
     std::array<uint8_t, 239> keysDown;
 
     bool isMaximized;
+    bool scale_published;
+    // Globals were bound but their initial events are yet to be read
+    bool globals_pending;
+    // Looked up by task_dispatch_loop, only used once task_state is TASK_SERVICE_READY
+    std::atomic<int> task_state;
     sp<IWaydroidTask> task;
+    // Same service when it implements 1.1, enables batched name lookups
+    sp<::vendor::waydroid::task::V1_1::IWaydroidTask> task_1_1;
+
+    // Background work for window creation, see window_worker_loop
+    std::list<std::function<void()>> window_work_queue;
+    std::mutex window_work_mutex;
+    std::condition_variable window_work_cond;
+    // Pre-created surfaces, protected by window_work_mutex
+    std::list<struct window *> window_pool;
+    size_t window_pool_size;
+    bool window_pool_subsurfaces;
+    // Resolved window titles, protected by window_work_mutex
+    std::map<std::string, std::string> app_names;
+    std::set<std::string> pending_app_names;
+    // Task service requests from the Wayland thread, see task_dispatch_loop
+    std::mutex task_mutex;
+    std::condition_variable task_cond;
+    int32_t pending_focus_task;
+    std::list<int32_t> pending_task_removals;
+    // Per-layer surfaces released by windows, only used from SurfaceFlinger's thread
+    struct pooledSurface surface_pool[SURFACE_POOL_MAX];
+    size_t surface_pool_count;
+    int64_t surface_idle_ns;
+    // Shared 1x1 window backgrounds keyed by ARGB color
+    std::map<uint32_t, struct wl_buffer *> bg_buffers;
 };
 
 struct buffer {
@@ -187,6 +318,11 @@ struct window {
     struct display *display;
     struct wl_surface *surface;
     struct wp_viewport *viewport;
+    struct surfaceState mainState;
+    // Subsurface state changed this frame, applied on the parent's commit
+    bool parentDirty;
+    // A configure was acked on the Wayland thread and awaits a commit
+    std::atomic<bool> ackPending;
     struct wl_shell_surface *shell_surface;
     struct xdg_surface *xdg_surface;
     struct xdg_toplevel *xdg_toplevel;
@@ -196,9 +332,13 @@ struct window {
     struct wl_subsurface *bg_subsurface;
     struct zwp_locked_pointer_v1 *locked_pointer;
     struct zwp_idle_inhibitor_v1 *idle_inhibitor;
-    std::map<size_t, struct wl_surface *> surfaces;
-    std::map<size_t, struct wl_subsurface *> subsurfaces;
-    std::map<size_t, struct wp_viewport *> viewports;
+    // Per-layer subsurfaces by position within the window, surfaceCount are in use
+    struct wl_surface *surfaces[MAX_LAYERS];
+    struct wl_subsurface *subsurfaces[MAX_LAYERS];
+    struct wp_viewport *viewports[MAX_LAYERS];
+    struct surfaceState surfaceStates[MAX_LAYERS];
+    int64_t surfaceUsedAt[MAX_LAYERS];
+    size_t surfaceCount;
     struct wl_callback *callback;
     struct buffer *last_layer_buffer;
     struct buffer *snapshot_buffer;
@@ -206,6 +346,15 @@ struct window {
     std::string appID;
     std::string taskID;
     bool isActive;
+    // Guards the Wayland objects against destroy_window for other threads
+    std::mutex mutex;
+    // Set by the compositor's close request, hwc_set destroys the window
+    std::atomic<bool> closed;
+    // Set from the Wayland thread once the first configure was acked
+    std::atomic<bool> configured;
+    hwc_color_t bg_color;
+    bool has_background;
+    bool bg_ready;
 };
 
 void
@@ -220,11 +369,17 @@ create_android_wl_buffer(struct display *display, struct buffer *buffer,
              int width, int height, int format,
              int pixel_stride, buffer_handle_t target);
 
+bool
+isFormatSupported(struct display *display, uint32_t format);
+int
+ConvertHalFormatToDrm(struct display *display, uint32_t hal_format);
+
 int
 create_dmabuf_wl_buffer(struct display *display, struct buffer *buffer,
              int width, int height, int hal_format, int format,
-             int prime_fd, int pixel_stride, int byte_stride,
-             int offset, uint64_t modifier, buffer_handle_t target);
+             int num_planes, const int *fds, const uint32_t *offsets,
+             const uint32_t *strides, int pixel_stride, uint64_t modifier,
+             buffer_handle_t target);
 
 int
 create_shm_wl_buffer(struct display *display, struct buffer *buffer,
@@ -237,10 +392,38 @@ struct display *
 create_display(const char* gralloc);
 void
 destroy_display(struct display *display);
+bool
+reconnect_display(struct display *display);
 
+int64_t
+monotonic_ns(void);
+int
+flush_display(struct display *display, int timeout_ms);
+std::shared_ptr<const windowList>
+get_windows(struct display *display);
 void
-destroy_window(struct window *window, bool keep = false);
-struct window *
+destroy_window(struct window *window);
+std::shared_ptr<struct window>
 create_window(struct display *display, bool with_dummy, std::string appID, std::string taskID, hwc_color_t color);
 void
+setup_window_background(struct window *window);
+void
+add_layer_surface(struct window *window, int64_t now);
+void
+trim_layer_surfaces(struct window *window, int64_t now);
+void
+trim_surface_pool(struct display *display, int64_t now);
+void
+prewarm_windows(struct display *display, bool use_subsurfaces, size_t count);
+void
+queue_window_work(struct display *display, std::function<void()> work);
+void*
+window_worker_loop(void* data);
+void
+queue_task_focus(struct display *display, int32_t taskID);
+void
+queue_task_removal(struct display *display, int32_t taskID);
+void*
+task_dispatch_loop(void* data);
+void
 choose_width_height(struct display* display, int32_t hint_width, int32_t hint_height);
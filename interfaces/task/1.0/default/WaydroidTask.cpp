@@ -16,68 +16,156 @@
 
 #include "WaydroidTask.h"
 
+#include <sys/stat.h>
 #include <utils/String16.h>
 #include <utils/String8.h>
 
+// Rewritten by PackageManager whenever a package is added, removed or updated
+#define PACKAGES_LIST "/data/system/packages.list"
+
 namespace vendor {
 namespace waydroid {
 namespace task {
-namespace V1_0 {
+namespace V1_1 {
 namespace implementation {
 
+// Several RPC threads may do the first lookup at once. The service manager
+// is queried without the lock, a failed lookup is retried on the next call.
+sp<IActivityTaskManager> WaydroidTask::getActivityTaskManager() {
+    {
+        std::scoped_lock lock(mServicesMutex);
+        if (mActivityTaskManager != nullptr)
+            return mActivityTaskManager;
+    }
+
+    sp<IBinder> binderTask = android::defaultServiceManager()->getService(android::String16("activity_task"));
+    if (binderTask == nullptr)
+        return nullptr;
+
+    std::scoped_lock lock(mServicesMutex);
+    if (mActivityTaskManager == nullptr)
+        mActivityTaskManager = android::interface_cast<IActivityTaskManager>(binderTask);
+    return mActivityTaskManager;
+}
+
+sp<IPlatform> WaydroidTask::getPlatform() {
+    {
+        std::scoped_lock lock(mServicesMutex);
+        if (mPlatform != nullptr)
+            return mPlatform;
+    }
+
+    sp<IBinder> binderPlatform = android::defaultServiceManager()->getService(android::String16("waydroidplatform"));
+    if (binderPlatform == nullptr)
+        return nullptr;
+
+    std::scoped_lock lock(mServicesMutex);
+    if (mPlatform == nullptr)
+        mPlatform = android::interface_cast<IPlatform>(binderPlatform);
+    return mPlatform;
+}
+
 // Methods from ::vendor::waydroid::task::V1_0::IWaydroidTask follow.
 Return<void> WaydroidTask::setFocusedTask(uint32_t taskID) {
-    if (mActivityTaskManager == nullptr) {
-        sp<IBinder> binderTask = android::defaultServiceManager()->getService(android::String16("activity_task"));
-        if (binderTask != nullptr)
-            mActivityTaskManager = android::interface_cast<IActivityTaskManager>(binderTask);
-    }
-    if (mActivityTaskManager != nullptr)
-        mActivityTaskManager->setFocusedTask(taskID);
+    sp<IActivityTaskManager> activityTaskManager = getActivityTaskManager();
+    if (activityTaskManager != nullptr)
+        activityTaskManager->setFocusedTask(taskID);
     return Void();
 }
 
 Return<void> WaydroidTask::removeTask(uint32_t taskID) {
     bool ret;
-    if (mActivityTaskManager == nullptr) {
-        sp<IBinder> binderTask = android::defaultServiceManager()->getService(android::String16("activity_task"));
-        if (binderTask != nullptr)
-            mActivityTaskManager = android::interface_cast<IActivityTaskManager>(binderTask);
-    }
-    if (mActivityTaskManager != nullptr)
-        mActivityTaskManager->removeTask(taskID, &ret);
+    sp<IActivityTaskManager> activityTaskManager = getActivityTaskManager();
+    if (activityTaskManager != nullptr)
+        activityTaskManager->removeTask(taskID, &ret);
     return Void();
 }
 
 Return<void> WaydroidTask::removeAllVisibleRecentTasks() {
-    if (mActivityTaskManager == nullptr) {
-        sp<IBinder> binderTask = android::defaultServiceManager()->getService(android::String16("activity_task"));
-        if (binderTask != nullptr)
-            mActivityTaskManager = android::interface_cast<IActivityTaskManager>(binderTask);
-    }
-    if (mActivityTaskManager != nullptr)
-        mActivityTaskManager->removeAllVisibleRecentTasks();
+    sp<IActivityTaskManager> activityTaskManager = getActivityTaskManager();
+    if (activityTaskManager != nullptr)
+        activityTaskManager->removeAllVisibleRecentTasks();
     return Void();
 }
 
-Return<void> WaydroidTask::getAppName(const hidl_string& packageName, getAppName_cb _hidl_cb) {
+void WaydroidTask::invalidateStaleAppNames() {
+    struct stat st;
+    if (stat(PACKAGES_LIST, &st) != 0)
+        return;
+    if (st.st_mtim.tv_sec == mPackagesMtime.tv_sec && st.st_mtim.tv_nsec == mPackagesMtime.tv_nsec)
+        return;
+    mPackagesMtime = st.st_mtim;
+    mAppNames.clear();
+    mAppNamesIndex.clear();
+}
+
+std::string WaydroidTask::lookupAppName(const std::string& packageName) {
+    {
+        std::scoped_lock lock(mAppNamesMutex);
+        invalidateStaleAppNames();
+        auto it = mAppNamesIndex.find(packageName);
+        if (it != mAppNamesIndex.end()) {
+            mAppNames.splice(mAppNames.begin(), mAppNames, it->second);
+            return it->second->second;
+        }
+    }
+
     android::String16 AppName;
-    if (mPlatform == nullptr) {
-        sp<IBinder> binderPlatform = android::defaultServiceManager()->getService(android::String16("waydroidplatform"));
-        if (binderPlatform != nullptr)
-            mPlatform = android::interface_cast<IPlatform>(binderPlatform);
+    sp<IPlatform> platform = getPlatform();
+    if (platform == nullptr || !platform->getAppName(android::String16(packageName.c_str()), &AppName).isOk())
+        // Don't cache failures, the platform service may just not be up yet
+        return packageName;
+
+    std::string OutAppName(android::String8(AppName).string());
+    if (OutAppName.empty())
+        OutAppName = packageName;
+
+    std::scoped_lock lock(mAppNamesMutex);
+    if (mAppNamesIndex.find(packageName) == mAppNamesIndex.end()) {
+        mAppNames.emplace_front(packageName, OutAppName);
+        mAppNamesIndex[packageName] = mAppNames.begin();
+        if (mAppNames.size() > APP_NAME_CACHE_SIZE) {
+            mAppNamesIndex.erase(mAppNames.back().first);
+            mAppNames.pop_back();
+        }
     }
-    if (mPlatform != nullptr)
-        mPlatform->getAppName(android::String16(packageName.c_str()), &AppName);
-    const char* OutAppName = android::String8(AppName).string();
-    if (strlen(OutAppName) == 0)
-        OutAppName = packageName.c_str();
-    _hidl_cb(OutAppName);
+    return OutAppName;
+}
+
+Return<void> WaydroidTask::getAppName(const hidl_string& packageName, getAppName_cb _hidl_cb) {
+    _hidl_cb(lookupAppName(packageName));
+    return Void();
+}
+
+// Methods from ::vendor::waydroid::task::V1_1::IWaydroidTask follow.
+Return<void> WaydroidTask::getAppNames(const hidl_vec<hidl_string>& packageNames, getAppNames_cb _hidl_cb) {
+    hidl_vec<hidl_string> names;
+    names.resize(packageNames.size());
+    for (size_t i = 0; i < packageNames.size(); i++)
+        names[i] = lookupAppName(packageNames[i]);
+    _hidl_cb(names);
     return Void();
 }
 
+Return<void> WaydroidTask::prefetchAppName(const hidl_string& packageName) {
+    lookupAppName(packageName);
+    return Void();
+}
+
+Return<void> WaydroidTask::setFocusedTaskAsync(uint32_t taskID) {
+    return setFocusedTask(taskID);
+}
+
+Return<void> WaydroidTask::removeTaskAsync(uint32_t taskID) {
+    return removeTask(taskID);
+}
+
+Return<void> WaydroidTask::removeAllVisibleRecentTasksAsync() {
+    return removeAllVisibleRecentTasks();
+}
+
 }  // namespace implementation
-}  // namespace V1_0
+}  // namespace V1_1
 }  // namespace task
 }  // namespace waydroid
 }  // namespace vendor
@@ -18,17 +18,22 @@
 
 #include <binder/IBinder.h>
 #include <binder/IServiceManager.h>
-#include <vendor/waydroid/task/1.0/IWaydroidTask.h>
+#include <vendor/waydroid/task/1.1/IWaydroidTask.h>
 #include <hidl/MQDescriptor.h>
 #include <hidl/Status.h>
 
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
 #include <android/app/IActivityTaskManager.h>
 #include <lineageos/waydroid/IPlatform.h>
 
 namespace vendor {
 namespace waydroid {
 namespace task {
-namespace V1_0 {
+namespace V1_1 {
 namespace implementation {
 
 using ::android::hardware::hidl_array;
@@ -43,19 +48,42 @@ using ::android::IBinder;
 using ::android::app::IActivityTaskManager;
 using ::lineageos::waydroid::IPlatform;
 
+// Upper bound of cached package labels
+#define APP_NAME_CACHE_SIZE 256
+
 struct WaydroidTask : public IWaydroidTask {
     // Methods from ::vendor::waydroid::task::V1_0::IWaydroidTask follow.
     Return<void> setFocusedTask(uint32_t taskID) override;
     Return<void> removeTask(uint32_t taskID) override;
     Return<void> removeAllVisibleRecentTasks() override;
     Return<void> getAppName(const hidl_string& packageName, getAppName_cb _hidl_cb) override;
+
+    // Methods from ::vendor::waydroid::task::V1_1::IWaydroidTask follow.
+    Return<void> getAppNames(const hidl_vec<hidl_string>& packageNames, getAppNames_cb _hidl_cb) override;
+    Return<void> prefetchAppName(const hidl_string& packageName) override;
+    Return<void> setFocusedTaskAsync(uint32_t taskID) override;
+    Return<void> removeTaskAsync(uint32_t taskID) override;
+    Return<void> removeAllVisibleRecentTasksAsync() override;
   private:
+    std::string lookupAppName(const std::string& packageName);
+    void invalidateStaleAppNames();
+    sp<IActivityTaskManager> getActivityTaskManager();
+    sp<IPlatform> getPlatform();
+
+    // Guards the lazily looked up services, calls arrive on several threads
+    std::mutex mServicesMutex;
     sp<IActivityTaskManager> mActivityTaskManager;
     sp<IPlatform> mPlatform;
+
+    // LRU cache of package name -> label, most recently used first
+    std::mutex mAppNamesMutex;
+    std::list<std::pair<std::string, std::string>> mAppNames;
+    std::unordered_map<std::string, std::list<std::pair<std::string, std::string>>::iterator> mAppNamesIndex;
+    struct timespec mPackagesMtime = {};
 };
 
 }  // namespace implementation
-}  // namespace V1_0
+}  // namespace V1_1
 }  // namespace task
 }  // namespace waydroid
 }  // namespace vendor
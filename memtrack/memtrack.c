@@ -1,5 +1,6 @@
 /*
  * Copyright (C) 2019 The Android-x86 Open Source Project
+ * Copyright (C) 2026 The Waydroid Project
  *
  * Licensed under the Apache License, Version 2.0 (the "License");
  * you may not use this file except in compliance with the License.
@@ -14,8 +15,260 @@
  * limitations under the License.
  */
 
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+
 #include <hardware/memtrack.h>
 
+/*
+ * Graphics memory is attributed to processes from /proc/<pid>/fdinfo:
+ *  - GRAPHICS is the size of every dma-buf the process holds an fd to,
+ *    which covers all gralloc buffers whichever allocator made them.
+ *  - GL is what the DRM driver reports for the process' render node
+ *    clients (drm-total-* or the older drm-memory-* keys), minus the
+ *    shared BOs that are already counted as dma-bufs.
+ *
+ * Scanning fdinfo is not free, and meminfo asks for every type of every
+ * process in a row, so results are cached for a short while.
+ */
+
+#define CACHE_SIZE 32
+#define CACHE_TTL_NS 1000000000ULL
+
+struct proc_usage {
+    pid_t pid;
+    uint64_t stamp;
+    uint64_t graphics;
+    uint64_t gl;
+};
+
+static struct proc_usage cache[CACHE_SIZE];
+static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* (key, bytes) pairs, so buffers seen through several fds count once */
+struct usage_entry {
+    uint64_t key;
+    uint64_t bytes;
+};
+
+struct usage_list {
+    struct usage_entry *entries;
+    size_t count;
+    size_t capacity;
+};
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+static void usage_add(struct usage_list *list, uint64_t key, uint64_t bytes)
+{
+    if (list->count == list->capacity) {
+        size_t capacity = list->capacity ? list->capacity * 2 : 64;
+        struct usage_entry *entries =
+            realloc(list->entries, capacity * sizeof(*entries));
+
+        if (!entries)
+            return;
+        list->entries = entries;
+        list->capacity = capacity;
+    }
+
+    list->entries[list->count].key = key;
+    list->entries[list->count].bytes = bytes;
+    list->count++;
+}
+
+static int usage_cmp(const void *a, const void *b)
+{
+    const struct usage_entry *ea = a, *eb = b;
+
+    return (ea->key > eb->key) - (ea->key < eb->key);
+}
+
+static uint64_t usage_sum(struct usage_list *list)
+{
+    uint64_t sum = 0;
+
+    qsort(list->entries, list->count, sizeof(*list->entries), usage_cmp);
+    for (size_t i = 0; i < list->count; i++) {
+        if (i && list->entries[i].key == list->entries[i - 1].key)
+            continue;
+        sum += list->entries[i].bytes;
+    }
+
+    free(list->entries);
+    list->entries = NULL;
+    list->count = list->capacity = 0;
+
+    return sum;
+}
+
+/*
+ * Parse "<value>[ KiB| MiB| GiB]" as used by the drm-* fdinfo keys.
+ */
+static uint64_t parse_bytes(const char *str)
+{
+    char *end;
+    uint64_t value = strtoull(str, &end, 10);
+
+    while (*end == ' ' || *end == '\t')
+        end++;
+
+    if (!strncmp(end, "KiB", 3))
+        value <<= 10;
+    else if (!strncmp(end, "MiB", 3))
+        value <<= 20;
+    else if (!strncmp(end, "GiB", 3))
+        value <<= 30;
+
+    return value;
+}
+
+static bool starts_with(const char *str, const char *prefix, const char **rest)
+{
+    size_t len = strlen(prefix);
+
+    if (strncmp(str, prefix, len))
+        return false;
+
+    *rest = str + len;
+    return true;
+}
+
+/*
+ * Look at one fd of the process and account it if it is a dma-buf or a
+ * DRM client.
+ */
+static void scan_fd(pid_t pid, const char *fd, struct usage_list *dmabufs,
+        struct usage_list *clients)
+{
+    char path[64], line[256];
+    const char *rest;
+    bool is_dmabuf = false, is_drm = false, has_total = false;
+    uint64_t size = 0, client_id = 0, total = 0, memory = 0, shared = 0, bytes;
+    struct stat st;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo/%s", pid, fd);
+    f = fopen(path, "re");
+    if (!f)
+        return;
+
+    while (fgets(line, (int)sizeof(line), f)) {
+        if (starts_with(line, "exp_name:", &rest)) {
+            is_dmabuf = true;
+        } else if (starts_with(line, "size:", &rest)) {
+            size = strtoull(rest, NULL, 10);
+        } else if (starts_with(line, "drm-driver:", &rest)) {
+            is_drm = true;
+        } else if (starts_with(line, "drm-client-id:", &rest)) {
+            client_id = strtoull(rest, NULL, 10);
+        } else if (starts_with(line, "drm-total-", &rest)) {
+            rest = strchr(rest, ':');
+            if (rest) {
+                total += parse_bytes(rest + 1);
+                has_total = true;
+            }
+        } else if (starts_with(line, "drm-memory-", &rest)) {
+            rest = strchr(rest, ':');
+            if (rest)
+                memory += parse_bytes(rest + 1);
+        } else if (starts_with(line, "drm-shared-", &rest)) {
+            rest = strchr(rest, ':');
+            if (rest)
+                shared += parse_bytes(rest + 1);
+        }
+    }
+    fclose(f);
+
+    if (is_dmabuf) {
+        /* the inode identifies the buffer behind dup()ed fds */
+        snprintf(path, sizeof(path), "/proc/%d/fd/%s", pid, fd);
+        if (!stat(path, &st))
+            usage_add(dmabufs, (uint64_t)st.st_ino, size);
+    } else if (is_drm) {
+        bytes = has_total ? total : memory;
+        bytes -= shared < bytes ? shared : bytes;
+        usage_add(clients, client_id, bytes);
+    }
+}
+
+static int scan_process(pid_t pid, struct proc_usage *usage)
+{
+    struct usage_list dmabufs = { NULL, 0, 0 }, clients = { NULL, 0, 0 };
+    struct dirent *de;
+    char path[64];
+    DIR *dir;
+
+    snprintf(path, sizeof(path), "/proc/%d/fdinfo", pid);
+    dir = opendir(path);
+    if (!dir)
+        return -errno;
+
+    while ((de = readdir(dir))) {
+        if (de->d_name[0] < '0' || de->d_name[0] > '9')
+            continue;
+        scan_fd(pid, de->d_name, &dmabufs, &clients);
+    }
+    closedir(dir);
+
+    usage->pid = pid;
+    usage->graphics = usage_sum(&dmabufs);
+    usage->gl = usage_sum(&clients);
+
+    return 0;
+}
+
+static int get_usage(pid_t pid, struct proc_usage *usage)
+{
+    uint64_t now = now_ns();
+    struct proc_usage *slot = &cache[0];
+    int err;
+
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache[i].pid == pid && now - cache[i].stamp < CACHE_TTL_NS) {
+            *usage = cache[i];
+            pthread_mutex_unlock(&cache_lock);
+            return 0;
+        }
+    }
+    pthread_mutex_unlock(&cache_lock);
+
+    err = scan_process(pid, usage);
+    if (err)
+        return err;
+    usage->stamp = now;
+
+    /* replace the stale entry for this pid, or the oldest one */
+    pthread_mutex_lock(&cache_lock);
+    for (int i = 0; i < CACHE_SIZE; i++) {
+        if (cache[i].pid == pid) {
+            slot = &cache[i];
+            break;
+        }
+        if (cache[i].stamp < slot->stamp)
+            slot = &cache[i];
+    }
+    *slot = *usage;
+    pthread_mutex_unlock(&cache_lock);
+
+    return 0;
+}
+
 static int memtrack_init(const struct memtrack_module *module)
 {
     if (!module)
@@ -24,6 +277,45 @@ static int memtrack_init(const struct memtrack_module *module)
     return 0;
 }
 
+static int memtrack_get_memory(const struct memtrack_module *module,
+        pid_t pid, int type, struct memtrack_record *records,
+        size_t *num_records)
+{
+    struct proc_usage usage;
+    int err;
+
+    if (!module || !num_records || type < 0 || type >= MEMTRACK_NUM_TYPES)
+        return -EINVAL;
+
+    if (type != MEMTRACK_TYPE_GRAPHICS && type != MEMTRACK_TYPE_GL) {
+        *num_records = 0;
+        return 0;
+    }
+
+    /* a zero count asks how many records there are */
+    if (*num_records == 0) {
+        *num_records = 1;
+        return 0;
+    }
+
+    if (!records)
+        return -EINVAL;
+
+    err = get_usage(pid, &usage);
+    if (err)
+        return err;
+
+    /* neither dma-buf nor driver memory shows up in smaps */
+    records[0].size_in_bytes =
+        (size_t)(type == MEMTRACK_TYPE_GRAPHICS ? usage.graphics : usage.gl);
+    records[0].flags = MEMTRACK_FLAG_SMAPS_UNACCOUNTED |
+        (type == MEMTRACK_TYPE_GRAPHICS ? MEMTRACK_FLAG_SHARED : MEMTRACK_FLAG_PRIVATE) |
+        MEMTRACK_FLAG_NONSECURE;
+    *num_records = 1;
+
+    return 0;
+}
+
 static struct hw_module_methods_t memtrack_module_methods = {
     .open = NULL,
 };
@@ -34,10 +326,11 @@ struct memtrack_module HAL_MODULE_INFO_SYM = {
         .module_api_version = MEMTRACK_MODULE_API_VERSION_0_1,
         .hal_api_version = HARDWARE_HAL_API_VERSION,
         .id = MEMTRACK_HARDWARE_MODULE_ID,
-        .name = "Dummy Memory Tracker HAL",
+        .name = "Memory Tracker HAL",
         .author = "The Android-x86 Open Source Project",
         .methods = &memtrack_module_methods,
     },
 
     .init = memtrack_init,
+    .getMemory = memtrack_get_memory,
 };